@@ -21,11 +21,19 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 #include <linux/kvmi.h>
 
 typedef int kvmi_timeout_t;
 
+/* access rights reported by kvmi_walk_gva() */
+#define KVMI_GVA_WRITABLE ( 1 << 0 )
+#define KVMI_GVA_USER     ( 1 << 1 )
+#define KVMI_GVA_NX       ( 1 << 2 )
+
+#define KVMI_INVALID_GPA ( ~0ULL )
+
 enum { KVMI_NOWAIT = 0, KVMI_WAIT = 150 };
 
 struct kvmi_dom_event {
@@ -62,6 +70,58 @@ struct kvmi_introspector2qemu {
 	/* ... */
 };
 
+struct kvmi_physical_vec {
+	unsigned long long gpa;
+	void *             buffer;
+	size_t             size;
+};
+
+/* guest RAM layout of the QEMU process, for kvmi_set_process_memory() */
+struct kvmi_process_range {
+	unsigned long long gpa;
+	unsigned long long hva;
+	unsigned long long size;
+};
+
+/* kvmi_dump_memory() flags */
+#define KVMI_DUMP_PAUSE ( 1 << 0 ) /* pause all vCPUs first (the caller replies to their pause events) */
+
+/*
+ * A byte pattern for kvmi_compile_patterns(), 0 mask bits are wildcards.
+ * It needs at least one byte without wildcard bits; the patterns without
+ * two such adjacent bytes are supported, but scanned for more slowly.
+ */
+struct kvmi_pattern {
+	const unsigned char *bytes;
+	const unsigned char *mask; /* NULL for an exact match */
+	size_t               length;
+};
+
+struct kvmi_map_stats {
+	unsigned long long maps;      /* remote v1 mapping requests */
+	unsigned long long retries;   /* retries while the host was busy */
+	unsigned long long slow_maps; /* mappings that needed more than a few seconds */
+	unsigned long long failures;
+};
+
+struct kvmi_ve_info {
+	unsigned int       exit_reason; /* 48, EPT violation */
+	bool               pending;     /* the semaphore is set, no #VE can be delivered */
+	unsigned long long qualification;
+	unsigned long long gla;
+	unsigned long long gpa;
+	unsigned short     eptp_index;
+	unsigned char      access; /* KVMI_PAGE_ACCESS_R/W/X */
+	bool               gla_valid;
+};
+
+struct kvmi_hook_stats {
+	unsigned long long faults;       /* #PF events checked against the hooks */
+	unsigned long long prefiltered;  /* rejected by the Bloom filter */
+	unsigned long long unmatched;    /* passed the filter, matched no hook */
+	unsigned long long auto_replies; /* answered by the library */
+};
+
 typedef enum { KVMI_LOG_LEVEL_DEBUG, KVMI_LOG_LEVEL_INFO, KVMI_LOG_LEVEL_WARNING, KVMI_LOG_LEVEL_ERROR } kvmi_log_level;
 
 typedef void ( *kvmi_log_cb )( kvmi_log_level level, const char *s, void *ctx );
@@ -72,6 +132,10 @@ extern "C" {
 
 typedef int ( *kvmi_new_guest_cb )( void *dom, unsigned char ( *uuid )[16], void *ctx );
 typedef int ( *kvmi_handshake_cb )( const struct kvmi_qemu2introspector *, struct kvmi_introspector2qemu *, void *ctx );
+typedef void ( *kvmi_map_cb )( void *dom, unsigned long long int gpa, void *addr, int err, void *ctx );
+typedef int ( *kvmi_scan_cb )( void *dom, unsigned long long int gpa, unsigned int pattern, void *ctx );
+typedef int ( *kvmi_dump_cb )( void *dom, unsigned long long done, unsigned long long total, void *ctx );
+typedef int ( *kvmi_hook_cb )( void *dom, struct kvmi_dom_event *ev, void *ctx );
 
 void *kvmi_init_vsock( unsigned int port, kvmi_new_guest_cb accept_cb, kvmi_handshake_cb hsk_cb, void *cb_ctx );
 void *kvmi_init_unix_socket( const char *socket, kvmi_new_guest_cb accept_cb, kvmi_handshake_cb hsk_cb, void *cb_ctx );
@@ -80,6 +144,10 @@ void  kvmi_close( void *ctx );
 void  kvmi_domain_close( void *dom, bool do_shutdown );
 bool  kvmi_domain_is_connected( const void *dom );
 int   kvmi_memory_mapping( void *dom, bool enable );
+int   kvmi_memory_fast_path( void *dom, bool enable );
+int   kvmi_set_process_memory( void *dom, pid_t pid, const struct kvmi_process_range *ranges, size_t count );
+int   kvmi_memory_premap( void *dom, bool enable );
+int   kvmi_set_mem_cache_limits( void *dom, size_t max_regions, size_t max_bytes );
 void  kvmi_domain_name( const void *dom, char *dest, size_t dest_size );
 int   kvmi_connection_fd( const void *dom );
 int   kvmi_get_version( void *dom, unsigned int *version );
@@ -91,12 +159,27 @@ int   kvmi_control_cr( void *dom, unsigned short vcpu, unsigned int cr, bool ena
 int   kvmi_control_msr( void *dom, unsigned short vcpu, unsigned int msr, bool enable );
 int   kvmi_control_singlestep( void *dom, unsigned short vcpu, bool enable );
 int   kvmi_translate_gva( void *dom, unsigned short vcpu, __u64 gva, __u64 *gpa );
+int   kvmi_walk_gva( void *dom, const struct kvm_sregs *sregs, __u64 gva, __u64 *gpa, __u64 *page_size,
+                     unsigned int *flags );
+int   kvmi_read_virtual( void *dom, const struct kvm_sregs *sregs, __u64 gva, void *buffer, size_t size );
+int   kvmi_write_virtual( void *dom, const struct kvm_sregs *sregs, __u64 gva, const void *buffer, size_t size );
+int   kvmi_tlb_enable( void *dom, size_t entries );
+void  kvmi_tlb_flush( void *dom );
+void  kvmi_tlb_invalidate( void *dom, __u64 cr3, __u64 gva );
+int   kvmi_tlb_stats( void *dom, unsigned long long *hits, unsigned long long *misses );
 int   kvmi_pause_all_vcpus( void *dom, unsigned int count );
 int   kvmi_set_page_access( void *dom, unsigned long long int *gpa, unsigned char *access, unsigned short count,
                             unsigned short view );
 int   kvmi_set_page_write_bitmap( void *dom, __u64 *gpa, __u32 *bitmap, unsigned short count );
+int   kvmi_set_page_access_range( void *dom, unsigned long long int gpa, unsigned long long npages,
+                                  unsigned char access, unsigned short view );
+int   kvmi_get_page_access( void *dom, const unsigned long long *gpa, unsigned char *access, size_t count,
+                            unsigned short view );
+int   kvmi_get_page_write_bitmap( void *dom, const unsigned long long *gpa, __u32 *bitmap, size_t count,
+                                  unsigned short view );
 int   kvmi_get_vcpu_count( void *dom, unsigned int *count );
 int64_t kvmi_get_starttime( const void *dom );
+ssize_t kvmi_translate_gva_vec( void *dom, unsigned short vcpu, const __u64 *gvas, __u64 *gpas, size_t count );
 int     kvmi_get_tsc_speed( void *dom, unsigned long long int *speed );
 int     kvmi_get_cpuid( void *dom, unsigned short vcpu, unsigned int function, unsigned int index, unsigned int *eax,
                         unsigned int *ebx, unsigned int *ecx, unsigned int *edx );
@@ -108,8 +191,37 @@ int     kvmi_inject_exception( void *dom, unsigned short vcpu, unsigned long lon
                                unsigned char vector );
 int     kvmi_read_physical( void *dom, unsigned long long int gpa, void *buffer, size_t size );
 int     kvmi_write_physical( void *dom, unsigned long long int gpa, const void *buffer, size_t size );
+int     kvmi_read_physical_vec( void *dom, const struct kvmi_physical_vec *vec, size_t count );
+int     kvmi_write_physical_vec( void *dom, const struct kvmi_physical_vec *vec, size_t count );
 void *  kvmi_map_physical_page( void *dom, unsigned long long int gpa );
 int     kvmi_unmap_physical_page( void *dom, void *addr );
+int     kvmi_map_physical_page_async( void *dom, unsigned long long int gpa, kvmi_map_cb cb, void *ctx );
+int     kvmi_get_map_stats( void *dom, struct kvmi_map_stats *stats );
+void *  kvmi_map_physical_range( void *dom, unsigned long long int gpa, size_t size );
+int     kvmi_unmap_physical_range( void *dom, void *addr );
+void *  kvmi_compile_patterns( const struct kvmi_pattern *patterns, unsigned int count );
+void    kvmi_free_patterns( void *patterns );
+int     kvmi_scan_memory( void *dom, const void *patterns, unsigned long long start_gfn, unsigned long long end_gfn,
+                          unsigned int threads, kvmi_scan_cb cb, void *ctx );
+void *  kvmi_page_hashes_create( void *dom, const unsigned long long *gfns, size_t count, unsigned int threads );
+void    kvmi_page_hashes_free( void *hashes );
+int     kvmi_page_hashes_mark_dirty( void *hashes, const unsigned long long *gfns, size_t count );
+void    kvmi_page_hashes_observe( void *hashes, const struct kvmi_dom_event *ev );
+int     kvmi_page_hashes_update( void *hashes, unsigned int threads, bool all, unsigned long long **changed,
+                                 size_t *changed_count );
+int     kvmi_set_desired_page_access( void *dom, const unsigned long long *gpa, const unsigned char *access,
+                                      size_t count, unsigned short view, size_t *sent );
+void    kvmi_reset_page_access_shadow( void *dom );
+int     kvmi_dirty_track( void *dom, unsigned short view, const unsigned long long *gfns, size_t count );
+int     kvmi_dirty_stop( void *dom );
+int     kvmi_dirty_collect_and_reset( void *dom, unsigned long long **gfns, size_t *count );
+int     kvmi_dump_memory( void *dom, int fd, unsigned int flags, unsigned int threads, kvmi_dump_cb cb, void *ctx );
+int     kvmi_hook_add( void *dom, unsigned long long gpa, unsigned long long size, unsigned char access,
+                       unsigned short view, kvmi_hook_cb cb, void *ctx, unsigned int *id );
+int     kvmi_hook_remove( void *dom, unsigned int id );
+int     kvmi_hook_dispatch( void *dom, struct kvmi_dom_event *ev );
+int     kvmi_hook_auto_reply( void *dom, bool enable );
+int     kvmi_get_hook_stats( void *dom, struct kvmi_hook_stats *stats );
 int     kvmi_get_registers( void *dom, unsigned short vcpu, struct kvm_regs *regs, struct kvm_sregs *sregs,
                             struct kvm_msrs *msrs, unsigned int *mode );
 int     kvmi_set_registers( void *dom, unsigned short vcpu, const struct kvm_regs *regs );
@@ -125,6 +237,8 @@ int     kvmi_queue_registers( void *batch, unsigned short vcpu, const struct kvm
 int     kvmi_queue_reply_event( void *batch, unsigned int msg_seq, const void *data, size_t data_size );
 int     kvmi_queue_page_access( void *batch, unsigned long long int *gpa, unsigned char *access, unsigned short count,
                                 unsigned short view );
+int     kvmi_queue_page_access_range( void *batch, unsigned long long int gpa, unsigned long long npages,
+                                      unsigned char access, unsigned short view );
 int     kvmi_queue_pause_vcpu( void *batch, unsigned short vcpu );
 int     kvmi_get_maximum_gfn( void *dom, unsigned long long *gfn );
 int     kvmi_spp_support( void *dom, bool *supported );
@@ -132,20 +246,42 @@ int     kvmi_ve_support( void *dom, bool *supported );
 int     kvmi_vmfunc_support( void *dom, bool *supported );
 int     kvmi_eptp_support( void *dom, bool *supported );
 int     kvmi_queue_spp_access( void *batch, __u64 *gpa, __u32 *bitmap, __u16 view, __u16 count );
+int     kvmi_control_spp( void *dom, bool enable );
+int     kvmi_spp_protect( void *dom, unsigned long long gpa, unsigned long long size, unsigned short view );
+int     kvmi_spp_unprotect( void *dom, unsigned long long gpa, unsigned long long size, unsigned short view );
+int     kvmi_spp_flush( void *dom );
 int     kvmi_set_ve_info_page( void *dom, unsigned short vcpu, unsigned long long int gpa );
 int     kvmi_set_ept_page_conv( void *dom, unsigned short index, unsigned long long gpa, bool sve );
 int     kvmi_get_ept_page_conv( void *dom, unsigned short index, unsigned long long gpa, bool *sve );
+int     kvmi_set_ept_pages_conv( void *dom, unsigned short view, const unsigned long long *gpa, size_t count,
+                                 bool sve );
+int     kvmi_control_ve( void *dom, unsigned short vcpu, unsigned long long int gpa, bool enable );
+int     kvmi_ve_enable( void *dom, unsigned short vcpu, bool alloc, unsigned long long *gpa );
+int     kvmi_ve_disable( void *dom, unsigned short vcpu );
+int     kvmi_ve_get_info( void *dom, unsigned short vcpu, struct kvmi_ve_info *info );
+int     kvmi_ve_rearm( void *dom, unsigned short vcpu );
+void    kvmi_ve_decode_info( const void *page, struct kvmi_ve_info *info );
 int     kvmi_switch_ept_view( void *dom, unsigned short vcpu, unsigned short view );
 int     kvmi_disable_ve( void *dom, unsigned short vcpu );
 int     kvmi_create_ept_view( void *dom, unsigned short *view );
 int     kvmi_destroy_ept_view( void *dom, unsigned short view );
 int     kvmi_get_ept_view( void *dom, unsigned short vcpu, unsigned short *view );
 int     kvmi_control_ept_view( void *dom, unsigned short vcpu, unsigned short view, bool visible );
+int     kvmi_get_ept_views( void *dom, unsigned short *views, size_t *count );
+int     kvmi_get_ept_view_visible( void *dom, unsigned short vcpu, unsigned short view, bool *visible );
+int     kvmi_queue_switch_ept_view( void *batch, unsigned short vcpu, unsigned short view );
+int     kvmi_switch_ept_views( void *dom, const unsigned short *vcpus, size_t count, unsigned short view );
 bool    kvmi_remote_mapping_v2( void );
 size_t  kvmi_get_pending_events( void *dom );
 int     kvmi_change_gfn( void *dom, unsigned short vcpu, unsigned short view, __u64 old_gfn, __u64 new_gfn );
 int     kvmi_alloc_gfn( void *dom, __u64 gfn );
 int     kvmi_free_gfn( void *dom, __u64 gfn );
+int     kvmi_get_next_available_gfn( void *dom, unsigned long long *gfn );
+int     kvmi_spare_gfn_alloc( void *dom, unsigned long long *gfn );
+int     kvmi_spare_gfn_free( void *dom, unsigned long long gfn );
+int     kvmi_alias_page( void *dom, unsigned long long gfn, unsigned short view, unsigned long long *alias_gfn );
+int     kvmi_unalias_page( void *dom, unsigned long long gfn, unsigned short view );
+int     kvmi_alias_release( void *dom );
 
 #ifdef __cplusplus
 }
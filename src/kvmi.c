@@ -29,6 +29,7 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stddef.h>
@@ -36,6 +37,8 @@
 #include <poll.h>
 #include <sys/stat.h>
 #include <stdarg.h>
+#include <time.h>
+#include <immintrin.h>
 #include <linux/kvm_para.h>
 #include <uuid/uuid.h>
 
@@ -44,6 +47,7 @@
 #include "list.h"
 
 #define MIN( X, Y ) ( ( X ) < ( Y ) ? ( X ) : ( Y ) )
+#define MAX( X, Y ) ( ( X ) > ( Y ) ? ( X ) : ( Y ) )
 
 /* remote mapping v1 */
 struct kvmi_mem_map {
@@ -81,12 +85,77 @@ struct sockaddr_vm {
 #define MIN_KVMI_VERSION         1
 #define MIN_HANDSHAKE_DATA       offsetof( struct kvmi_qemu2introspector, name )
 #define MAX_HANDSHAKE_DATA       ( 64 * 1024 )
-#define MAX_MAP_RETRIES          30
-#define MAP_RETRY_WARNING        3
-#define MAP_RETRY_SLEEP_SECS     1
+#define MAP_RETRY_TIMEOUT_SECS   30
+#define MAP_RETRY_WARNING_SECS   3
+#define MAP_RETRY_MIN_USECS      100
+#define MAP_RETRY_MAX_USECS      100000
+#define MAP_TOKEN_POOL           16
+#define MAX_PIPELINED_MSGS       1024
+#define MAX_PIPELINED_CHUNKS     ( IOV_MAX / 2 )
+#define MAX_PIPELINED_BYTES      ( 64 * 1024 )
+#define SCAN_CHUNK_PAGES         256
+#define MAX_WORKER_THREADS       64
+#define DUMP_CHUNK_PAGES         256
+#define PAGE_ACCESS_MAX_ENTRIES                                                                                        \
+	( ( KVMI_MSG_SIZE - sizeof( struct kvmi_set_page_access ) ) / sizeof( struct kvmi_page_access_entry ) )
+#define PAGE_QUERY_MAX_ENTRIES   ( ( KVMI_MSG_SIZE - sizeof( struct kvmi_get_page_access ) ) / sizeof( __u64 ) )
+#define PAGE_QUERY_PIPELINE      ( MAX_PIPELINED_BYTES / KVMI_MSG_SIZE )
+#define SHADOW_LEAF_BITS         12
+#define SHADOW_MID_BITS          12
+#define SHADOW_VALID             0x80
+#define HOOK_FILTER_BITS         ( 1ULL << 20 )
+#define SPP_SUBPAGES             32
+#define SPP_SUBPAGE_SHIFT        7
+#define SPP_BITMAP_MAX_ENTRIES                                                                                         \
+	( ( KVMI_MSG_SIZE - sizeof( struct kvmi_set_page_write_bitmap ) ) / sizeof( struct kvmi_page_write_bitmap_entry ) )
+#define DIRTY_PROTECTED_ACCESS ( KVMI_PAGE_ACCESS_R | KVMI_PAGE_ACCESS_X )
+#define MAX_EPT_VIEWS          512 /* the size of the EPTP list */
+#define VE_INFO_SIZE           40
 
 #define KVMI_MAX_TIMEOUT 15000
 
+/* x86 paging */
+#define X86_CR0_PG     ( 1ULL << 31 )
+#define X86_CR4_PSE    ( 1ULL << 4 )
+#define X86_CR4_PAE    ( 1ULL << 5 )
+#define X86_CR4_LA57   ( 1ULL << 12 )
+#define X86_EFER_LMA   ( 1ULL << 10 )
+#define X86_EFER_NXE   ( 1ULL << 11 )
+#define X86_PTE_P      ( 1ULL << 0 )
+#define X86_PTE_RW     ( 1ULL << 1 )
+#define X86_PTE_US     ( 1ULL << 2 )
+#define X86_PTE_PS     ( 1ULL << 7 )
+#define X86_PTE_NX     ( 1ULL << 63 )
+#define X86_PTE_ADDR   0x000ffffffffff000ULL
+#define X86_PAGE_SHIFT 12
+
+struct kvmi_hook {
+	unsigned int       id;
+	unsigned short     view;
+	unsigned long long start; /* [start, end) gpa */
+	unsigned long long end;
+	unsigned char      access; /* the rights removed */
+	kvmi_hook_cb       cb;
+	void *             ctx;
+	unsigned short     max_view; /* the largest (view, end) of its subtree */
+	unsigned long long max_end;
+};
+
+/* the write protection requests for the 128-byte subpages of a page */
+struct kvmi_spp_page {
+	unsigned long long gfn;
+	unsigned short     view;
+	unsigned short     refs[SPP_SUBPAGES];
+	__u32              sent; /* the last write bitmap sent */
+	bool               dirty;
+};
+
+struct kvmi_vcpu_views {
+	unsigned short view;
+	bool           view_known;
+	__u64          visible[MAX_EPT_VIEWS / 64];
+};
+
 struct kvmi_mem_region {
 	unsigned long long start;
 	void *             virt;
@@ -94,6 +163,47 @@ struct kvmi_mem_region {
 	unsigned int       refcount;
 
 	list_t link;
+	list_t lru;
+};
+
+struct kvmi_premap_slot {
+	void * virt;
+	size_t length;
+};
+
+/* the #VE info page of a vCPU */
+struct kvmi_ve_vcpu {
+	unsigned long long gpa;
+	void *             page; /* NULL if it could not be mapped */
+	bool               enabled;
+	bool               allocated; /* a spare gfn */
+};
+
+/* a guest page backed by a spare gfn in one view */
+struct kvmi_page_alias {
+	unsigned long long gfn;
+	unsigned long long alias_gfn;
+	unsigned short     view;
+
+	list_t link;
+};
+
+/* a contiguous view over several mapped regions */
+struct kvmi_mem_window {
+	void * virt;
+	size_t length;
+	void **refs;
+	size_t ref_count;
+
+	list_t link;
+};
+
+struct kvmi_tlb_entry {
+	__u64        cr3;
+	__u64        page; /* gva >> shift */
+	__u64        gpa;  /* page base */
+	unsigned int shift;
+	unsigned int flags;
 };
 
 struct kvmi_dom {
@@ -103,8 +213,74 @@ struct kvmi_dom {
 	bool                          disconnected;
 	int                           mem_fd;
 	bool                          mem_remote;
+	bool                          mem_fast_path;
+	pid_t                         proc_pid;
+	struct kvmi_process_range *   proc_ranges;
+	size_t                        proc_count;
 	list_t                        mem_cache;
 	pthread_mutex_t               mem_lock;
+	void **                       premap;
+	unsigned long long            premap_gfns;
+	struct kvmi_premap_slot *     premap_slots;
+	size_t                        premap_count;
+	list_t                        mem_lru;
+	list_t                        mem_windows;
+	struct kvmi_mem_token         tokens[MAP_TOKEN_POOL];
+	unsigned int                  token_count;
+	pthread_mutex_t               token_lock;
+	struct kvmi_map_stats         map_stats;
+	list_t                        map_queue;
+	pthread_mutex_t               map_lock;
+	pthread_cond_t                map_cond;
+	pthread_t                     map_th_id;
+	bool                          map_th_started;
+	bool                          map_th_stop;
+	struct kvmi_tlb_entry *       tlb;
+	size_t                        tlb_size;
+	unsigned long long            tlb_hits;
+	unsigned long long            tlb_misses;
+	__u64 *                       vcpu_cr3;
+	unsigned int                  vcpu_cr3_count;
+	pthread_mutex_t               tlb_lock;
+	__u64 *                       dirty_tracked; /* gfn bitmaps */
+	__u64 *                       dirty_bits;
+	unsigned long long            dirty_gfns;
+	unsigned short                dirty_view;
+	unsigned long long            dirty_faults;
+	pthread_mutex_t               dirty_lock;
+	list_t                        access_shadows;
+	pthread_mutex_t               shadow_lock;
+	struct kvmi_hook **           hooks; /* sorted by view and start */
+	size_t                        hook_count;
+	size_t                        hook_alloc;
+	int                           hook_levels; /* of the interval tree, -1 if empty */
+	unsigned int                  hook_next_id;
+	__u64 *                       hook_filter; /* Bloom filter of the hooked gfns */
+	bool                          hook_auto_reply;
+	struct kvmi_hook_stats        hook_stats;
+	pthread_mutex_t               hooks_lock;
+	pthread_mutex_t               hooks_apply_lock;
+	struct kvmi_spp_page *        spp_pages; /* sorted by view and gfn */
+	size_t                        spp_count;
+	size_t                        spp_alloc;
+	bool                          spp_enabled;
+	pthread_mutex_t               spp_lock;
+	__u64                         views_created[MAX_EPT_VIEWS / 64];
+	struct kvmi_vcpu_views *      vcpu_views;
+	size_t                        vcpu_views_count;
+	pthread_mutex_t               views_lock;
+	unsigned long long *          spare_gfns; /* allocated, not in use */
+	size_t                        spare_count;
+	size_t                        spare_alloc;
+	list_t                        aliases;
+	pthread_mutex_t               alias_lock;
+	struct kvmi_ve_vcpu *         ve_vcpus;
+	size_t                        ve_vcpu_count;
+	pthread_mutex_t               ve_lock;
+	size_t                        lru_regions;
+	size_t                        lru_bytes;
+	size_t                        lru_max_regions;
+	size_t                        lru_max_bytes;
 	void *                        cb_ctx;
 	struct kvmi_dom_event *       events;
 	struct kvmi_dom_event *       event_last;
@@ -165,6 +341,18 @@ struct kvmi_set_page_write_bitmap_msg {
 	struct kvmi_set_page_write_bitmap cmd;
 };
 
+/* KVMI_WRITE_PHYSICAL starts with the same fields as KVMI_READ_PHYSICAL */
+struct kvmi_physical_msg {
+	struct kvmi_msg_hdr       hdr;
+	struct kvmi_read_physical cmd;
+};
+
+struct kvmi_switch_ept_view_msg {
+	struct kvmi_msg_hdr             hdr;
+	struct kvmi_vcpu_hdr            vcpu;
+	struct kvmi_switch_ept_view_req cmd;
+};
+
 struct kvmi_pause_vcpu_msg {
 	struct kvmi_msg_hdr    hdr;
 	struct kvmi_vcpu_hdr   vcpu;
@@ -182,6 +370,27 @@ static int  recv_reply( struct kvmi_dom *dom, const struct kvmi_msg_hdr *req, vo
 static int  __kvmi_get_version( void *dom, unsigned int *version, struct kvmi_features *features );
 static int  __kvmi_batch_commit( struct kvmi_batch *grp, bool wait_for_reply );
 static void __kvmi_mem_cache_cleanup( struct kvmi_dom *dom );
+static void kvmi_premap_release( struct kvmi_dom *dom );
+static void kvmi_mem_windows_release( struct kvmi_dom *dom );
+static void kvmi_flush_map_tokens( struct kvmi_dom *dom );
+static void kvmi_stop_map_worker( struct kvmi_dom *dom );
+static void kvmi_tlb_observe_event( struct kvmi_dom *dom, const struct kvmi_dom_event *ev );
+static bool kvmi_dirty_intercept( struct kvmi_dom *dom, const struct kvmi_dom_event *ev );
+static void kvmi_hooks_free( struct kvmi_dom *dom );
+static void kvmi_aliases_free( struct kvmi_dom *dom );
+static void kvmi_views_observe_event( struct kvmi_dom *dom, const struct kvmi_dom_event *ev );
+static void kvmi_views_set_vcpu( struct kvmi_dom *dom, unsigned short vcpu, unsigned short view, bool known );
+static bool kvmi_views_get_vcpu( struct kvmi_dom *dom, unsigned short vcpu, unsigned short *view );
+static void kvmi_views_set_created( struct kvmi_dom *dom, unsigned short view, bool created );
+static void kvmi_views_set_visible( struct kvmi_dom *dom, unsigned short vcpu, unsigned short view, bool visible );
+static bool kvmi_hook_intercept( struct kvmi_dom *dom, const struct kvmi_dom_event *ev );
+static void kvmi_shadow_update( struct kvmi_dom *dom, unsigned short view, const unsigned long long *gpa,
+                                const unsigned char *access, size_t count, bool known );
+static void kvmi_shadow_update_range( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn,
+                                      unsigned long long count, unsigned char access, bool known );
+static unsigned char kvmi_hooks_removed( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn );
+static unsigned char kvmi_page_access_wanted( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn,
+                                              bool protect );
 
 bool kvmi_remote_mapping_v2( void )
 {
@@ -342,7 +551,10 @@ static int kvmi_open_kvmmem( struct kvmi_dom *dom )
 static void kvmi_close_kvmmem( struct kvmi_dom *dom )
 {
 	if ( dom->mem_fd != -1 ) {
-		if ( mem_v2 )
+		kvmi_mem_windows_release( dom );
+		kvmi_premap_release( dom );
+		kvmi_flush_map_tokens( dom );
+		if ( mem_v2 || !dom->mem_remote )
 			__kvmi_mem_cache_cleanup( dom );
 		close( dom->mem_fd );
 		dom->mem_fd = -1;
@@ -361,6 +573,36 @@ int kvmi_memory_mapping( void *d, bool enable )
 	return kvmi_open_kvmmem( dom );
 }
 
+/*
+ * With remote v1 mapping, a page that is neither premapped nor kept by the
+ * region cache costs a map request, a copy and an unmap request: more than
+ * the socket read/write it would replace.
+ */
+static bool kvmi_mapping_is_cached( const struct kvmi_dom *dom )
+{
+	return !dom->mem_remote || mem_v2 || dom->premap || dom->lru_max_regions || dom->lru_max_bytes;
+}
+
+/*
+ * Makes kvmi_read_physical()/kvmi_write_physical() copy through the mapped
+ * memory. Refused (EINVAL) while the remote v1 mapping has neither
+ * premapped slots nor a region cache budget; the socket is used in that
+ * case, also when the budget is removed later.
+ */
+int kvmi_memory_fast_path( void *d, bool enable )
+{
+	struct kvmi_dom *dom = d;
+
+	if ( enable && dom->mem_fd >= 0 && !kvmi_mapping_is_cached( dom ) ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	dom->mem_fast_path = enable;
+
+	return 0;
+}
+
 static void check_if_disconnected( struct kvmi_dom *dom, int err, kvmi_timeout_t ms, bool can_timeout )
 {
 	if ( dom->disconnected || !err )
@@ -995,10 +1237,29 @@ static void *accept_worker( void *_ctx )
 		if ( !dom )
 			break;
 
-		dom->fd     = fd;
-		dom->mem_fd = -1;
+		dom->fd          = fd;
+		dom->mem_fd      = -1;
+		dom->hook_levels = -1;
 		INIT_LIST_HEAD( &dom->mem_cache );
+		INIT_LIST_HEAD( &dom->mem_lru );
+		INIT_LIST_HEAD( &dom->mem_windows );
 		pthread_mutex_init( &dom->mem_lock, NULL );
+		pthread_mutex_init( &dom->token_lock, NULL );
+		INIT_LIST_HEAD( &dom->map_queue );
+		pthread_mutex_init( &dom->map_lock, NULL );
+		pthread_cond_init( &dom->map_cond, NULL );
+		pthread_mutex_init( &dom->tlb_lock, NULL );
+		pthread_mutex_init( &dom->dirty_lock, NULL );
+		INIT_LIST_HEAD( &dom->access_shadows );
+		INIT_LIST_HEAD( &dom->aliases );
+		pthread_mutex_init( &dom->shadow_lock, NULL );
+		pthread_mutex_init( &dom->hooks_lock, NULL );
+		pthread_mutex_init( &dom->hooks_apply_lock, NULL );
+		pthread_mutex_init( &dom->spp_lock, NULL );
+		pthread_mutex_init( &dom->views_lock, NULL );
+		pthread_mutex_init( &dom->alias_lock, NULL );
+		pthread_mutex_init( &dom->ve_lock, NULL );
+		dom->views_created[0] = 1; /* the default view */
 		pthread_mutex_init( &dom->event_lock, NULL );
 		pthread_mutex_init( &dom->lock, NULL );
 
@@ -1167,6 +1428,7 @@ void kvmi_domain_close( void *d, bool do_shutdown )
 	if ( !dom )
 		return;
 
+	kvmi_stop_map_worker( dom );
 	kvmi_close_kvmmem( dom );
 
 	if ( do_shutdown )
@@ -1181,6 +1443,31 @@ void kvmi_domain_close( void *d, bool do_shutdown )
 	}
 
 	pthread_mutex_destroy( &dom->mem_lock );
+	pthread_mutex_destroy( &dom->token_lock );
+	pthread_mutex_destroy( &dom->map_lock );
+	pthread_cond_destroy( &dom->map_cond );
+	pthread_mutex_destroy( &dom->tlb_lock );
+	pthread_mutex_destroy( &dom->dirty_lock );
+	kvmi_reset_page_access_shadow( dom );
+	pthread_mutex_destroy( &dom->shadow_lock );
+	kvmi_hooks_free( dom );
+	pthread_mutex_destroy( &dom->hooks_lock );
+	pthread_mutex_destroy( &dom->hooks_apply_lock );
+	free( dom->spp_pages );
+	pthread_mutex_destroy( &dom->spp_lock );
+	free( dom->vcpu_views );
+	pthread_mutex_destroy( &dom->views_lock );
+	kvmi_aliases_free( dom );
+	pthread_mutex_destroy( &dom->alias_lock );
+	/* the info pages were unmapped with the memory cache */
+	free( dom->ve_vcpus );
+	pthread_mutex_destroy( &dom->ve_lock );
+
+	free( dom->tlb );
+	free( dom->dirty_tracked );
+	free( dom->dirty_bits );
+	free( dom->vcpu_cr3 );
+	free( dom->proc_ranges );
 	pthread_mutex_destroy( &dom->event_lock );
 	pthread_mutex_destroy( &dom->lock );
 
@@ -1339,6 +1626,15 @@ static int kvmi_push_event( struct kvmi_dom *dom, unsigned int seq, unsigned int
 	new_event->seq  = seq;
 	new_event->next = NULL;
 
+	kvmi_tlb_observe_event( dom, new_event );
+	kvmi_views_observe_event( dom, new_event );
+
+	/* handled by the library, the vCPU has already been resumed */
+	if ( kvmi_dirty_intercept( dom, new_event ) || kvmi_hook_intercept( dom, new_event ) ) {
+		free( new_event );
+		return 0;
+	}
+
 	pthread_mutex_lock( &dom->event_lock );
 	/* Don't queue events ad infinitum */
 	if ( dom->event_count < MAX_QUEUED_EVENTS ) {
@@ -1503,6 +1799,40 @@ static int recv_reply( struct kvmi_dom *dom, const struct kvmi_msg_hdr *req, voi
 	return recv_reply_data( dom, incoming, dest, dest_size );
 }
 
+/*
+ * Like recv_reply(), but an error code sent by the host is returned as a
+ * positive errno value, after the reply was fully consumed, so that the
+ * following pipelined replies can still be received. -1 is returned only
+ * when the connection can no longer be used.
+ */
+static int recv_pipelined_reply( struct kvmi_dom *dom, const struct kvmi_msg_hdr *req, void *dest,
+                                 size_t *dest_size )
+{
+	struct kvmi_error_code ec;
+	size_t                 incoming;
+
+	if ( recv_reply_header( dom, req, &incoming ) )
+		return -1;
+
+	if ( incoming < sizeof( ec ) ) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	if ( do_read( dom, &ec, sizeof( ec ) ) )
+		return -1;
+
+	incoming -= sizeof( ec );
+
+	if ( ec.err ) {
+		if ( consume_bytes( dom, incoming ) )
+			return -1;
+		return convert_kvm_error_to_errno( ec.err );
+	}
+
+	return recv_reply_data( dom, incoming, dest, dest_size );
+}
+
 static int request_raw( struct kvmi_dom *dom, const void *src, size_t src_size, void *dest, size_t *dest_size )
 {
 	struct iovec               iov = { .iov_base = ( void * )src, .iov_len = src_size };
@@ -1676,6 +2006,8 @@ int kvmi_set_page_access( void *dom, unsigned long long int *gpa, unsigned char
 		free( msg );
 	}
 
+	kvmi_shadow_update( dom, view, gpa, access, count, !err );
+
 	return err;
 }
 
@@ -1694,6 +2026,9 @@ int kvmi_queue_page_access( void *grp, unsigned long long int *gpa, unsigned cha
 
 	free( msg );
 
+	/* the outcome is known only after the commit */
+	kvmi_shadow_update( ( ( struct kvmi_batch * )grp )->dom, view, gpa, access, count, false );
+
 	return err;
 }
 
@@ -1756,6 +2091,174 @@ int kvmi_queue_spp_access( void *grp, __u64 *gpa, __u32 *bitmap, __u16 view, __u
 	return err;
 }
 
+/*
+ * The entries are generated one message at a time (the batch commits
+ * itself when full), so the memory used does not depend on the range
+ * size. The protocol has no range entries, so every page still takes one
+ * kvmi_page_access_entry on the wire.
+ */
+int kvmi_queue_page_access_range( void *_grp, unsigned long long int gpa, unsigned long long npages,
+                                  unsigned char access, unsigned short view )
+{
+	struct kvmi_batch *              grp = _grp;
+	struct kvmi_set_page_access_msg *msg;
+	unsigned long long               gfn = gpa >> pageshift;
+	int                              err = 0;
+
+	msg = malloc( sizeof( *msg ) + PAGE_ACCESS_MAX_ENTRIES * sizeof( msg->cmd.entries[0] ) );
+	if ( !msg )
+		return -1;
+
+	/* the outcome is known only after the commit */
+	kvmi_shadow_update_range( grp->dom, view, gfn, npages, access, false );
+
+	while ( npages && !err ) {
+		size_t count = MIN( npages, PAGE_ACCESS_MAX_ENTRIES );
+		size_t size  = sizeof( *msg ) + count * sizeof( msg->cmd.entries[0] );
+		size_t k;
+
+		memset( msg, 0, size );
+
+		msg->hdr.id    = KVMI_SET_PAGE_ACCESS;
+		msg->hdr.seq   = new_seq();
+		msg->hdr.size  = size - sizeof( msg->hdr );
+		msg->cmd.count = count;
+		msg->cmd.view  = view;
+
+		for ( k = 0; k < count; k++ ) {
+			msg->cmd.entries[k].gpa    = ( gfn + k ) << pageshift;
+			msg->cmd.entries[k].access = access;
+		}
+
+		err = kvmi_batch_add( grp, msg, size );
+
+		gfn += count;
+		npages -= count;
+	}
+
+	free( msg );
+
+	return err;
+}
+
+int kvmi_set_page_access_range( void *dom, unsigned long long int gpa, unsigned long long npages,
+                                unsigned char access, unsigned short view )
+{
+	void *grp;
+	int   err = -1;
+
+	grp = kvmi_batch_alloc( dom );
+	if ( !grp )
+		return -1;
+
+	if ( !kvmi_queue_page_access_range( grp, gpa, npages, access, view ) )
+		err = kvmi_batch_commit( grp );
+
+	kvmi_batch_free( grp );
+
+	if ( !err )
+		kvmi_shadow_update_range( dom, view, gpa >> pageshift, npages, access, true );
+
+	return err;
+}
+
+/* KVMI_GET_PAGE_ACCESS and KVMI_GET_PAGE_WRITE_BITMAP have the same layout */
+struct kvmi_page_query_msg {
+	struct kvmi_msg_hdr         hdr;
+	struct kvmi_get_page_access cmd;
+	__u64                       gpa[PAGE_QUERY_MAX_ENTRIES];
+};
+
+/*
+ * Splits the query in messages as large as possible and sends them in
+ * groups (with one write), whose replies land directly in 'out'.
+ */
+static int kvmi_query_pages( struct kvmi_dom *dom, unsigned short id, const unsigned long long *gpa, void *out,
+                             size_t elem_size, size_t count, unsigned short view )
+{
+	struct kvmi_page_query_msg *msgs;
+	struct iovec                iov[PAGE_QUERY_PIPELINE];
+	size_t                      start[PAGE_QUERY_PIPELINE];
+	size_t                      done = 0;
+	int                         cmd_err = 0;
+	int                         err     = 0;
+
+	msgs = malloc( PAGE_QUERY_PIPELINE * sizeof( *msgs ) );
+	if ( !msgs )
+		return -1;
+
+	pthread_mutex_lock( &dom->lock );
+
+	while ( !err && done < count ) {
+		size_t n, k, total = 0;
+
+		for ( n = 0; n < PAGE_QUERY_PIPELINE && done < count; n++ ) {
+			struct kvmi_page_query_msg *msg = &msgs[n];
+			size_t                      cnt = MIN( PAGE_QUERY_MAX_ENTRIES, count - done );
+
+			memset( &msg->cmd, 0, sizeof( msg->cmd ) );
+			msg->hdr.id    = id;
+			msg->hdr.seq   = new_seq();
+			msg->hdr.size  = sizeof( msg->cmd ) + cnt * sizeof( msg->gpa[0] );
+			msg->cmd.view  = view;
+			msg->cmd.count = cnt;
+			memcpy( msg->gpa, gpa + done, cnt * sizeof( msg->gpa[0] ) );
+
+			iov[n].iov_base = msg;
+			iov[n].iov_len  = sizeof( msg->hdr ) + msg->hdr.size;
+			total += iov[n].iov_len;
+
+			start[n] = done;
+			done += cnt;
+		}
+
+		err = do_write( dom, iov, n, total );
+
+		for ( k = 0; !err && k < n; k++ ) {
+			size_t expected = msgs[k].cmd.count * elem_size;
+			size_t size     = expected;
+			int    ret;
+
+			ret = recv_pipelined_reply( dom, &msgs[k].hdr, ( char * )out + start[k] * elem_size, &size );
+			if ( ret < 0 )
+				err = -1;
+			else if ( !cmd_err )
+				cmd_err = ret ? ret : ( size < expected ? ENODATA : 0 );
+		}
+	}
+
+	pthread_mutex_unlock( &dom->lock );
+
+	free( msgs );
+
+	if ( !err && cmd_err ) {
+		errno = cmd_err;
+		err   = -1;
+	}
+
+	return err;
+}
+
+/* the rights found are also recorded in the access shadow */
+int kvmi_get_page_access( void *d, const unsigned long long *gpa, unsigned char *access, size_t count,
+                          unsigned short view )
+{
+	struct kvmi_dom *dom = d;
+	int              err;
+
+	err = kvmi_query_pages( dom, KVMI_GET_PAGE_ACCESS, gpa, access, sizeof( *access ), count, view );
+	if ( !err )
+		kvmi_shadow_update( dom, view, gpa, access, count, true );
+
+	return err;
+}
+
+int kvmi_get_page_write_bitmap( void *dom, const unsigned long long *gpa, __u32 *bitmap, size_t count,
+                                unsigned short view )
+{
+	return kvmi_query_pages( dom, KVMI_GET_PAGE_WRITE_BITMAP, gpa, bitmap, sizeof( *bitmap ), count, view );
+}
+
 int kvmi_get_vcpu_count( void *dom, unsigned int *count )
 {
 	struct kvmi_get_guest_info_reply rpl;
@@ -1861,19 +2364,43 @@ int kvmi_inject_exception( void *dom, unsigned short vcpu, unsigned long long in
 	return request( dom, KVMI_INJECT_EXCEPTION, &req, sizeof( req ), NULL, NULL );
 }
 
-int kvmi_read_physical( void *dom, unsigned long long int gpa, void *buffer, size_t size )
+static int kvmi_physical_pipeline( struct kvmi_dom *dom, const struct kvmi_physical_vec *vec, size_t count,
+                                   bool write );
+
+static bool crosses_page( unsigned long long int gpa, size_t size )
+{
+	return ( gpa & ( pagesize - 1 ) ) + size > ( size_t )pagesize;
+}
+
+static int kvmi_copy_guest_range( struct kvmi_dom *dom, __u64 gpa, void *buf, size_t size, bool write );
+
+static int socket_read_physical( struct kvmi_dom *dom, unsigned long long int gpa, void *buffer, size_t size )
 {
 	struct kvmi_read_physical req = { .gpa = gpa, .size = size };
 
+	/* large reads are split into page-sized requests and pipelined */
+	if ( crosses_page( gpa, size ) ) {
+		struct kvmi_physical_vec vec = { .gpa = gpa, .buffer = buffer, .size = size };
+
+		return kvmi_physical_pipeline( dom, &vec, 1, false );
+	}
+
 	return request( dom, KVMI_READ_PHYSICAL, &req, sizeof( req ), buffer, &size );
 }
 
-int kvmi_write_physical( void *dom, unsigned long long int gpa, const void *buffer, size_t size )
+static int socket_write_physical( struct kvmi_dom *dom, unsigned long long int gpa, const void *buffer,
+                                  size_t size )
 {
 	struct kvmi_write_physical *req;
 	size_t                      req_size = sizeof( *req ) + size;
 	int                         err      = -1;
 
+	if ( crosses_page( gpa, size ) ) {
+		struct kvmi_physical_vec vec = { .gpa = gpa, .buffer = ( void * )buffer, .size = size };
+
+		return kvmi_physical_pipeline( dom, &vec, 1, true );
+	}
+
 	req = malloc( req_size );
 	if ( !req )
 		return -1;
@@ -1889,868 +2416,6075 @@ int kvmi_write_physical( void *dom, unsigned long long int gpa, const void *buff
 	return err;
 }
 
-static struct kvmi_mem_region *kvmi_mem_cache_lookup_gpa( struct kvmi_dom *dom, unsigned long long int gpa )
+static bool kvmi_physical_fast_path( struct kvmi_dom *dom )
 {
-	list_t *                i;
-	struct kvmi_mem_region *reg;
+	return dom->mem_fast_path && dom->mem_fd >= 0 && kvmi_mapping_is_cached( dom );
+}
 
-	list_for_each( i, &dom->mem_cache )
-	{
-		reg = list_container( i, struct kvmi_mem_region, link );
+static int kvmi_copy_physical( struct kvmi_dom *dom, __u64 gpa, void *buf, size_t size, bool write )
+{
+	if ( kvmi_physical_fast_path( dom ) )
+		return kvmi_copy_guest_range( dom, gpa, buf, size, write );
 
-		if ( gpa >= reg->start && gpa < reg->start + reg->length )
-			return reg;
-	}
+	if ( write )
+		return socket_write_physical( dom, gpa, buf, size );
+	return socket_read_physical( dom, gpa, buf, size );
+}
 
-	return NULL;
+static int compare_process_ranges( const void *a, const void *b )
+{
+	const struct kvmi_process_range *r1 = a;
+	const struct kvmi_process_range *r2 = b;
+
+	if ( r1->gpa < r2->gpa )
+		return -1;
+	return r1->gpa > r2->gpa;
 }
 
-static struct kvmi_mem_region *kvmi_mem_cache_lookup_virt( struct kvmi_dom *dom, void *addr )
+/*
+ * Sets the guest RAM layout of the (co-located) QEMU process, so that
+ * guest memory can be accessed with process_vm_readv()/process_vm_writev()
+ * instead of the socket. A zero pid (or no ranges) disables this backend.
+ * Not to be called while other threads access the guest memory.
+ */
+int kvmi_set_process_memory( void *d, pid_t pid, const struct kvmi_process_range *ranges, size_t count )
 {
-	list_t *                i;
-	struct kvmi_mem_region *reg;
+	struct kvmi_dom *          dom = d;
+	struct kvmi_process_range *copy;
+	size_t                     k;
 
-	list_for_each( i, &dom->mem_cache )
-	{
-		reg = list_container( i, struct kvmi_mem_region, link );
+	if ( !pid || !count ) {
+		free( dom->proc_ranges );
+		dom->proc_ranges = NULL;
+		dom->proc_count  = 0;
+		dom->proc_pid    = 0;
+		return 0;
+	}
 
-		if ( addr >= reg->virt && ( char * )addr < ( char * )reg->virt + reg->length )
-			return reg;
+	copy = malloc( count * sizeof( *copy ) );
+	if ( !copy )
+		return -1;
+
+	memcpy( copy, ranges, count * sizeof( *copy ) );
+	qsort( copy, count, sizeof( *copy ), compare_process_ranges );
+
+	for ( k = 0; k < count; k++ ) {
+		if ( !copy[k].size || copy[k].gpa + copy[k].size < copy[k].gpa
+		     || ( k && copy[k - 1].gpa + copy[k - 1].size > copy[k].gpa ) ) {
+			free( copy );
+			errno = EINVAL;
+			return -1;
+		}
 	}
 
-	return NULL;
+	free( dom->proc_ranges );
+	dom->proc_ranges = copy;
+	dom->proc_count  = count;
+	dom->proc_pid    = pid;
+
+	return 0;
 }
 
-static void *kvmi_map_physical_page_v2( void *d, unsigned long long int gpa )
+/*
+ * Returns the range that contains gpa or, if gpa falls in a hole, the first
+ * range above it (NULL past the last range).
+ */
+static const struct kvmi_process_range *kvmi_process_range_next( struct kvmi_dom *dom, __u64 gpa )
 {
-	struct kvmi_dom *     dom = d;
-	struct kvmi_mem_token token;
-	size_t                received = sizeof( token );
+	size_t lo = 0, hi = dom->proc_count;
 
-	struct kvmi_guest_mem_map map_req;
-	struct kvmi_mem_region *  reg;
-	int                       err;
-	void *                    result;
+	while ( lo < hi ) {
+		size_t                           mid = lo + ( hi - lo ) / 2;
+		const struct kvmi_process_range *r   = &dom->proc_ranges[mid];
 
-	pthread_mutex_lock( &dom->mem_lock );
-again:
-	/* first look-up physical address in region cache */
-	reg = kvmi_mem_cache_lookup_gpa( dom, gpa );
-	if ( reg ) {
-		reg->refcount++;
-		result = ( char * )reg->virt + ( gpa - reg->start );
-		goto out;
+		if ( gpa - r->gpa < r->size )
+			return r;
+		if ( gpa < r->gpa )
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
 
-	pthread_mutex_unlock( &dom->mem_lock );
+	return lo < dom->proc_count ? &dom->proc_ranges[lo] : NULL;
+}
 
-	/* request token from host */
-	err = request( dom, KVMI_GET_MAP_TOKEN, NULL, 0, &token, &received );
-	if ( err )
-		return MAP_FAILED;
+/* the on-stack batch of the short requests; longer vectors get IOV_MAX */
+#define PROCESS_BATCH_SEGS 64
 
-	pthread_mutex_lock( &dom->mem_lock );
+struct kvmi_process_batch {
+	struct iovec *local;
+	struct iovec *remote;
+	size_t        max;
+	size_t        count;
+	size_t        bytes;
+};
 
-	/* fill request */
-	memset( &map_req, 0, sizeof( struct kvmi_guest_mem_map ) );
-	memcpy( &map_req.token, &token, sizeof( map_req.token ) );
-	map_req.gpa = gpa;
+static int kvmi_process_flush( struct kvmi_dom *dom, struct kvmi_process_batch *b, bool write )
+{
+	ssize_t n;
 
-	/* request region mapping */
-	err = ioctl( dom->mem_fd, KVM_GUEST_MEM_MAP, &map_req );
-	if ( err && errno != EALREADY ) {
-		int _errno = errno;
-		pthread_mutex_unlock( &dom->mem_lock );
-		errno = _errno;
-		return MAP_FAILED;
-	}
-	/* map_req.gpa now contains the starting gpa of the mapped region */
+	if ( !b->count )
+		return 0;
 
-	/* another thread managed to add the region */
-	if ( err )
-		goto again;
+	if ( write )
+		n = process_vm_writev( dom->proc_pid, b->local, b->count, b->remote, b->count, 0 );
+	else
+		n = process_vm_readv( dom->proc_pid, b->local, b->count, b->remote, b->count, 0 );
 
-	result = mmap( NULL, map_req.length, PROT_READ | PROT_WRITE, MAP_SHARED, dom->mem_fd, map_req.gpa );
-	if ( result == MAP_FAILED ) {
-		int _errno = errno;
-		ioctl( dom->mem_fd, KVM_GUEST_MEM_UNMAP, map_req.gpa );
-		pthread_mutex_unlock( &dom->mem_lock );
-		errno = _errno;
-		return MAP_FAILED;
+	if ( n < 0 )
+		return -1;
+
+	if ( ( size_t )n != b->bytes ) {
+		errno = EFAULT;
+		return -1;
 	}
 
-	reg = malloc( sizeof( *reg ) );
-	if ( !reg ) {
-		int _errno = errno;
-		munmap( result, map_req.length );
-		ioctl( dom->mem_fd, KVM_GUEST_MEM_UNMAP, map_req.gpa );
-		pthread_mutex_unlock( &dom->mem_lock );
-		errno = _errno;
-		return MAP_FAILED;
-	}
-
-	/* add region to cache */
-	reg->start    = map_req.gpa;
-	reg->length   = map_req.length;
-	reg->virt     = result;
-	reg->refcount = 1;
-	list_add_tail( &dom->mem_cache, &reg->link );
-
-	result = ( char * )reg->virt + ( gpa - reg->start );
-
-out:
-	pthread_mutex_unlock( &dom->mem_lock );
+	b->count = 0;
+	b->bytes = 0;
 
-	return result;
+	return 0;
 }
 
-static int kvmi_unmap_physical_page_v2( void *d, void *addr )
+/*
+ * Copies guest memory from/to the QEMU process with as few
+ * process_vm_readv()/process_vm_writev() calls as possible. The segments
+ * of a short request are batched on the stack, those of a longer vector
+ * up to IOV_MAX at a time. The parts that are not covered by the known
+ * RAM layout are copied the usual way.
+ */
+static int kvmi_process_copy( struct kvmi_dom *dom, const struct kvmi_physical_vec *vec, size_t count, bool write )
 {
-	struct kvmi_dom *       dom = d;
-	struct kvmi_mem_region *reg;
-	int                     _errno;
-	int                     err = 0;
+	struct iovec               local[PROCESS_BATCH_SEGS], remote[PROCESS_BATCH_SEGS];
+	struct kvmi_process_batch  batch = { .local = local, .remote = remote, .max = PROCESS_BATCH_SEGS };
+	struct kvmi_process_batch *b     = &batch;
+	int                        err   = 0;
+	size_t                     k;
 
-	/* validate input address */
-	if ( addr == NULL ) {
-		errno = EINVAL;
-		return -1;
-	}
+	if ( count > PROCESS_BATCH_SEGS ) {
+		struct iovec *iov = malloc( 2 * IOV_MAX * sizeof( *iov ) );
 
-	pthread_mutex_lock( &dom->mem_lock );
+		if ( !iov )
+			return -1;
 
-	/* look-up region by local virtual address */
-	reg = kvmi_mem_cache_lookup_virt( dom, addr );
-	if ( !reg ) {
-		pthread_mutex_unlock( &dom->mem_lock );
-		errno = ENXIO;
-		return -1;
+		b->local  = iov;
+		b->remote = iov + IOV_MAX;
+		b->max    = IOV_MAX;
 	}
 
-	/* dec region reference count & unmap region if unreferenced */
-	reg->refcount--;
-	if ( reg->refcount == 0 ) {
-		munmap( reg->virt, reg->length );
-		err    = ioctl( dom->mem_fd, KVM_GUEST_MEM_UNMAP, reg->start );
-		_errno = errno;
-		list_del( &reg->link );
-		free( reg );
-		errno = _errno;
+	for ( k = 0; k < count && !err; k++ ) {
+		__u64  gpa  = vec[k].gpa;
+		char * buf  = vec[k].buffer;
+		size_t size = vec[k].size;
+
+		while ( size && !err ) {
+			const struct kvmi_process_range *r = kvmi_process_range_next( dom, gpa );
+			size_t                           chunk;
+
+			if ( !r || r->gpa > gpa ) {
+				/* a hole (or the memory past the last range) */
+				chunk = size;
+				if ( r && r->gpa - gpa < size )
+					chunk = r->gpa - gpa;
+
+				err = kvmi_process_flush( dom, b, write );
+				if ( !err )
+					err = kvmi_copy_physical( dom, gpa, buf, chunk, write );
+			} else {
+				chunk = MIN( size, r->size - ( gpa - r->gpa ) );
+
+				if ( b->count == b->max && kvmi_process_flush( dom, b, write ) ) {
+					err = -1;
+					break;
+				}
+
+				b->local[b->count].iov_base  = buf;
+				b->local[b->count].iov_len   = chunk;
+				b->remote[b->count].iov_base = ( void * )( uintptr_t )( r->hva + ( gpa - r->gpa ) );
+				b->remote[b->count].iov_len  = chunk;
+				b->count++;
+				b->bytes += chunk;
+			}
+
+			gpa += chunk;
+			buf += chunk;
+			size -= chunk;
+		}
 	}
 
-	pthread_mutex_unlock( &dom->mem_lock );
+	if ( !err )
+		err = kvmi_process_flush( dom, b, write );
+
+	if ( b->local != local )
+		free( b->local );
 
 	return err;
 }
 
-static void __kvmi_mem_cache_cleanup( struct kvmi_dom *dom )
+int kvmi_read_physical( void *d, unsigned long long int gpa, void *buffer, size_t size )
 {
-	list_t *                i;
-	list_t *                j;
-	struct kvmi_mem_region *reg;
+	struct kvmi_dom *dom = d;
 
-	/* unmap remaining regions - there should be none left */
-	list_for_each_safe_reverse( i, j, &dom->mem_cache )
-	{
-		reg = list_container( i, struct kvmi_mem_region, link );
+	if ( dom->proc_pid ) {
+		struct kvmi_physical_vec vec = { .gpa = gpa, .buffer = buffer, .size = size };
 
-		munmap( reg->virt, reg->length );
-		ioctl( dom->mem_fd, KVM_GUEST_MEM_UNMAP, reg->start );
-		free( reg );
+		return kvmi_process_copy( dom, &vec, 1, false );
 	}
 
-	INIT_LIST_HEAD( &dom->mem_cache );
+	return kvmi_copy_physical( dom, gpa, buffer, size, false );
 }
 
-static void *kvmi_map_physical_page_v1( void *d, unsigned long long int gpa )
+int kvmi_write_physical( void *d, unsigned long long int gpa, const void *buffer, size_t size )
 {
 	struct kvmi_dom *dom = d;
 
-	errno = 0;
+	if ( dom->proc_pid ) {
+		struct kvmi_physical_vec vec = { .gpa = gpa, .buffer = ( void * )buffer, .size = size };
 
-	void *addr = mmap( NULL, pagesize, PROT_READ | PROT_WRITE,
-	                   MAP_LOCKED | MAP_POPULATE | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		return kvmi_process_copy( dom, &vec, 1, true );
+	}
 
-	if ( addr != MAP_FAILED ) {
-		struct kvmi_mem_token token;
-		struct kvmi_mem_map   map_req;
-		int                   retries = 0;
-		int                   err;
+	return kvmi_copy_physical( dom, gpa, ( void * )buffer, size, true );
+}
+
+struct kvmi_physical_pipeline {
+	struct kvmi_physical_msg msgs[MAX_PIPELINED_CHUNKS];
+	char *                   bufs[MAX_PIPELINED_CHUNKS];
+	struct iovec             iov[2 * MAX_PIPELINED_CHUNKS];
+	size_t                   head;     /* oldest request without reply */
+	size_t                   inflight; /* requests without reply */
+	size_t                   bytes;    /* data bytes of these requests */
+	const struct kvmi_physical_vec *vec;
+	size_t                          count;
+	size_t                          k;   /* current entry */
+	size_t                          off; /* offset in the current entry */
+	bool                            write;
+};
 
-		do {
-			size_t received = sizeof( token );
+/* prepares the next page-bounded chunk, if any */
+static bool kvmi_physical_pipeline_next( struct kvmi_physical_pipeline *p, size_t slot )
+{
+	struct kvmi_physical_msg *msg = &p->msgs[slot];
+	__u64                     gpa;
+	size_t                    size;
 
-			err = request( dom, KVMI_GET_MAP_TOKEN, NULL, 0, &token, &received );
+	while ( p->k < p->count && p->off == p->vec[p->k].size ) {
+		p->k++;
+		p->off = 0;
+	}
 
-			if ( !err ) {
-				/* fill IOCTL arg */
-				memcpy( &map_req.token, &token, sizeof( struct kvmi_mem_token ) );
-				map_req.gpa = gpa;
-				map_req.gva = ( __u64 )addr;
+	if ( p->k == p->count )
+		return false;
 
-				/* do map IOCTL request */
-				err = ioctl( dom->mem_fd, KVM_INTRO_MEM_MAP, &map_req );
-			}
+	gpa  = p->vec[p->k].gpa + p->off;
+	size = MIN( p->vec[p->k].size - p->off, ( size_t )pagesize - ( gpa & ( pagesize - 1 ) ) );
 
-			if ( err && ( errno == EAGAIN || errno == EBUSY ) ) {
-				if ( retries++ == MAP_RETRY_WARNING )
-					kvmi_log_warning( "Slow mapping for gpa %llx", gpa );
-				if ( retries < MAX_MAP_RETRIES )
-					sleep( MAP_RETRY_SLEEP_SECS );
-			} else
-				break;
-		} while ( retries < MAX_MAP_RETRIES );
+	msg->hdr.id   = p->write ? KVMI_WRITE_PHYSICAL : KVMI_READ_PHYSICAL;
+	msg->hdr.seq  = new_seq();
+	msg->hdr.size = sizeof( msg->cmd ) + ( p->write ? size : 0 );
+	msg->cmd.gpa  = gpa;
+	msg->cmd.size = size;
+	p->bufs[slot] = ( char * )p->vec[p->k].buffer + p->off;
 
-		if ( err ) {
-			int _errno = errno;
-			munmap( addr, pagesize );
-			errno = _errno;
-			addr  = MAP_FAILED;
-		}
-	}
+	p->off += size;
 
-	return addr;
+	return true;
 }
 
-static int kvmi_unmap_physical_page_v1( void *d, void *addr )
+/* fills the window with new requests, sent with one write */
+static int kvmi_physical_pipeline_fill( struct kvmi_dom *dom, struct kvmi_physical_pipeline *p )
 {
-	const struct kvmi_dom *dom = d;
-	int                    _errno;
-	int                    err;
-
-	/* do unmap IOCTL request */
-	err    = ioctl( dom->mem_fd, KVM_INTRO_MEM_UNMAP, addr );
-	_errno = errno;
+	size_t iov_cnt = 0, total = 0;
 
-	munmap( addr, pagesize );
+	while ( p->inflight < MAX_PIPELINED_CHUNKS && p->bytes < MAX_PIPELINED_BYTES ) {
+		size_t slot = ( p->head + p->inflight ) % MAX_PIPELINED_CHUNKS;
 
-	errno = _errno;
+		if ( !kvmi_physical_pipeline_next( p, slot ) )
+			break;
 
-	return err;
-}
+		p->iov[iov_cnt].iov_base = &p->msgs[slot];
+		p->iov[iov_cnt].iov_len  = sizeof( p->msgs[slot] );
+		total += p->iov[iov_cnt++].iov_len;
 
-static void *kvmi_map_physical_page_host( void *d, unsigned long long int gpa )
-{
-	struct kvmi_dom *dom = d;
+		if ( p->write ) {
+			/* the payload is sent straight from the caller's buffer */
+			p->iov[iov_cnt].iov_base = p->bufs[slot];
+			p->iov[iov_cnt].iov_len  = p->msgs[slot].cmd.size;
+			total += p->iov[iov_cnt++].iov_len;
+		}
 
-	struct kvmi_mem_region *region;
-	struct kvmi_query_physical req;
-	struct kvmi_query_physical_reply rpl;
-	size_t received = sizeof( rpl );
-	int err;
+		p->inflight++;
+		p->bytes += p->msgs[slot].cmd.size;
+	}
 
-	pthread_mutex_lock( &dom->mem_lock );
+	if ( !iov_cnt )
+		return 0;
 
-	/* first look-up physical address in region cache */
-	region = kvmi_mem_cache_lookup_gpa( dom, gpa );
-	if ( region ) {
-		region->refcount++;
-		goto out;
-	}
+	return do_write( dom, p->iov, iov_cnt, total );
+}
 
-	region = malloc( sizeof( *region ) );
-	if ( !region ) {
-		pthread_mutex_unlock( &dom->mem_lock );
-		return MAP_FAILED;
-	}
+/*
+ * Splits every entry at page boundaries (a message is limited to
+ * KVMI_MSG_SIZE) and keeps a sliding window of KVMI_READ_PHYSICAL or
+ * KVMI_WRITE_PHYSICAL commands in flight. Reply data lands directly into
+ * the caller's buffers and write payloads are sent from them. The window
+ * is limited by IOV_MAX and by the reply bytes that can be pending in the
+ * socket (so the host never blocks writing replies while we are still
+ * sending) and is refilled, with one write, once half of it is consumed.
+ */
+static int kvmi_physical_pipeline( struct kvmi_dom *dom, const struct kvmi_physical_vec *vec, size_t count,
+                                   bool write )
+{
+	struct kvmi_physical_pipeline *p;
+	int                            cmd_err = 0;
+	int                            err     = 0;
 
-	/* fill request */
-	req.gfn = gpa >> pageshift;
+	p = calloc( 1, sizeof( *p ) );
+	if ( !p )
+		return -1;
 
-	/* request mem slot */
-	err = request( dom, KVMI_QUERY_PHYSICAL, &req, sizeof( req ), &rpl, &received );
+	p->vec   = vec;
+	p->count = count;
+	p->write = write;
 
-	if ( err ) {
-		free( region );
-		pthread_mutex_unlock( &dom->mem_lock );
-		return MAP_FAILED;
-	}
+	pthread_mutex_lock( &dom->lock );
 
-	region->start  = rpl.gfn << pageshift;
-	region->length = rpl.size * pagesize;
-	region->virt = mmap( NULL, region->length, PROT_READ | PROT_WRITE, MAP_SHARED, dom->mem_fd, region->start );
-	if ( region->virt == MAP_FAILED ) {
-		free( region );
-		pthread_mutex_unlock( &dom->mem_lock );
-		return MAP_FAILED;
-	}
+	err = kvmi_physical_pipeline_fill( dom, p );
 
-	/* add region to cache */
-	region->refcount = 1;
-	list_add_tail( &dom->mem_cache, &region->link );
+	while ( !err && p->inflight ) {
+		struct kvmi_physical_msg *msg  = &p->msgs[p->head];
+		size_t                    size = msg->cmd.size;
+		int                       ret;
 
-out:
-	pthread_mutex_unlock( &dom->mem_lock );
+		ret = recv_pipelined_reply( dom, &msg->hdr, write ? NULL : p->bufs[p->head], write ? NULL : &size );
+		if ( ret < 0 ) {
+			err = -1;
+			break;
+		}
 
-	return ( char * )region->virt + ( gpa - region->start );
-}
+		if ( ret && !cmd_err )
+			cmd_err = ret;
 
-static int kvmi_unmap_physical_page_host( void *d, void *addr )
-{
-	struct kvmi_dom *       dom = d;
-	struct kvmi_mem_region *reg;
-	int                     err = 0;
+		p->bytes -= msg->cmd.size;
+		p->inflight--;
+		p->head = ( p->head + 1 ) % MAX_PIPELINED_CHUNKS;
 
-	/* validate input address */
-	if ( addr == NULL ) {
-		errno = EINVAL;
-		return -1;
+		if ( p->inflight <= MAX_PIPELINED_CHUNKS / 2 && p->bytes <= MAX_PIPELINED_BYTES / 2 )
+			err = kvmi_physical_pipeline_fill( dom, p );
 	}
 
-	pthread_mutex_lock( &dom->mem_lock );
+	pthread_mutex_unlock( &dom->lock );
 
-	/* look-up region by local virtual address */
-	reg = kvmi_mem_cache_lookup_virt( dom, addr );
-	if ( !reg ) {
-		pthread_mutex_unlock( &dom->mem_lock );
-		errno = ENXIO;
-		return -1;
-	}
+	free( p );
 
-	/* dec region reference count & unmap region if unreferenced */
-	reg->refcount--;
-	if ( reg->refcount == 0 ) {
-		munmap( reg->virt, reg->length );
-		list_del( &reg->link );
-		free( reg );
+	if ( !err && cmd_err ) {
+		errno = cmd_err;
+		err   = -1;
 	}
 
-	pthread_mutex_unlock( &dom->mem_lock );
-
 	return err;
 }
 
-void *kvmi_map_physical_page( void *d, unsigned long long int gpa )
+int kvmi_read_physical_vec( void *d, const struct kvmi_physical_vec *vec, size_t count )
 {
 	struct kvmi_dom *dom = d;
 
-	if ( !dom->mem_remote && dom->mem_fd >= 0 )
-		return kvmi_map_physical_page_host( d, gpa );
+	if ( dom->proc_pid )
+		return kvmi_process_copy( dom, vec, count, false );
 
-	return mem_v2 ? kvmi_map_physical_page_v2( d, gpa ) : kvmi_map_physical_page_v1( d, gpa );
+	return kvmi_physical_pipeline( dom, vec, count, false );
 }
 
-int kvmi_unmap_physical_page( void *d, void *addr )
+int kvmi_write_physical_vec( void *d, const struct kvmi_physical_vec *vec, size_t count )
 {
 	struct kvmi_dom *dom = d;
 
-	if ( !dom->mem_remote && dom->mem_fd >= 0 )
-		return kvmi_unmap_physical_page_host( d, addr );
+	if ( dom->proc_pid )
+		return kvmi_process_copy( dom, vec, count, true );
 
-	return mem_v2 ? kvmi_unmap_physical_page_v2( d, addr ) : kvmi_unmap_physical_page_v1( d, addr );
+	return kvmi_physical_pipeline( dom, vec, count, true );
 }
 
-static void *alloc_get_registers_req( unsigned short vcpu, struct kvm_msrs *msrs, size_t *req_size )
+static struct kvmi_mem_region *kvmi_mem_cache_lookup_gpa( struct kvmi_dom *dom, unsigned long long int gpa )
 {
-	struct {
-		struct kvmi_vcpu_hdr      vcpu;
-		struct kvmi_get_registers regs;
-	} * req;
-
-	*req_size = sizeof( *req ) + sizeof( __u32 ) * msrs->nmsrs;
-	req       = calloc( 1, *req_size );
-
-	if ( req ) {
-		unsigned int k = 0;
+	list_t *                i;
+	struct kvmi_mem_region *reg;
 
-		req->vcpu.vcpu  = vcpu;
-		req->regs.nmsrs = msrs->nmsrs;
+	list_for_each( i, &dom->mem_cache )
+	{
+		reg = list_container( i, struct kvmi_mem_region, link );
 
-		for ( ; k < msrs->nmsrs; k++ )
-			req->regs.msrs_idx[k] = msrs->entries[k].index;
+		if ( gpa >= reg->start && gpa < reg->start + reg->length )
+			return reg;
 	}
 
-	return req;
+	return NULL;
 }
 
-static int process_get_registers_reply( struct kvmi_dom *dom, size_t received, struct kvm_regs *regs,
-                                        struct kvm_sregs *sregs, struct kvm_msrs *msrs, unsigned int *mode )
+static struct kvmi_mem_region *kvmi_mem_cache_lookup_virt( struct kvmi_dom *dom, void *addr )
 {
-	struct kvmi_get_registers_reply rpl;
+	list_t *                i;
+	struct kvmi_mem_region *reg;
 
-	if ( received != sizeof( rpl ) + sizeof( struct kvm_msr_entry ) * msrs->nmsrs ) {
-		errno = E2BIG;
-		return -1;
-	}
+	list_for_each( i, &dom->mem_cache )
+	{
+		reg = list_container( i, struct kvmi_mem_region, link );
 
-	if ( do_read( dom, &rpl, sizeof( rpl ) ) )
-		return -1;
+		if ( addr >= reg->virt && ( char * )addr < ( char * )reg->virt + reg->length )
+			return reg;
+	}
 
-	if ( do_read( dom, &msrs->entries, sizeof( struct kvm_msr_entry ) * msrs->nmsrs ) )
-		return -1;
+	return NULL;
+}
 
-	memcpy( regs, &rpl.regs, sizeof( *regs ) );
-	memcpy( sregs, &rpl.sregs, sizeof( *sregs ) );
-	*mode = rpl.mode;
+static void kvmi_mem_lru_del( struct kvmi_dom *dom, struct kvmi_mem_region *reg )
+{
+	list_del( &reg->lru );
+	dom->lru_regions--;
+	dom->lru_bytes -= reg->length;
+}
 
-	return 0;
+static void kvmi_mem_region_get( struct kvmi_dom *dom, struct kvmi_mem_region *reg )
+{
+	/* an unreferenced region waiting in the LRU list is back in use */
+	if ( reg->refcount++ == 0 )
+		kvmi_mem_lru_del( dom, reg );
 }
 
-int kvmi_get_registers( void *d, unsigned short vcpu, struct kvm_regs *regs, struct kvm_sregs *sregs,
-                        struct kvm_msrs *msrs, unsigned int *mode )
+static int kvmi_mem_region_free( struct kvmi_dom *dom, struct kvmi_mem_region *reg )
 {
-	struct kvmi_dom *dom = d;
-	void *           req;
-	size_t           req_size;
-	size_t           received;
-	int              err = -1;
+	int _errno;
+	int err = 0;
 
-	req = alloc_get_registers_req( vcpu, msrs, &req_size );
+	munmap( reg->virt, reg->length );
+	if ( dom->mem_remote )
+		err = ioctl( dom->mem_fd, KVM_GUEST_MEM_UNMAP, reg->start );
+	_errno = errno;
+	list_del( &reg->link );
+	free( reg );
+	errno = _errno;
 
-	if ( !req )
-		return -1;
+	return err;
+}
 
-	pthread_mutex_lock( &dom->lock );
+static bool kvmi_mem_lru_over_budget( const struct kvmi_dom *dom )
+{
+	if ( dom->lru_max_regions && dom->lru_regions > dom->lru_max_regions )
+		return true;
 
-	err = request_varlen_response( dom, KVMI_GET_REGISTERS, req, req_size, &received );
+	if ( dom->lru_max_bytes && dom->lru_bytes > dom->lru_max_bytes )
+		return true;
 
-	if ( !err )
-		err = process_get_registers_reply( dom, received, regs, sregs, msrs, mode );
+	return false;
+}
 
-	pthread_mutex_unlock( &dom->lock );
+static void kvmi_mem_lru_evict( struct kvmi_dom *dom, bool all )
+{
+	while ( dom->lru_regions && ( all || kvmi_mem_lru_over_budget( dom ) ) ) {
+		struct kvmi_mem_region *reg = list_container( dom->mem_lru.next, struct kvmi_mem_region, lru );
 
-	free( req );
+		kvmi_mem_lru_del( dom, reg );
+		kvmi_mem_region_free( dom, reg );
+	}
+}
 
-	return err;
-}
-
-static void setup_kvmi_set_registers_msg( struct kvmi_set_registers_msg *msg, unsigned short vcpu,
-                                          const struct kvm_regs *regs )
+/*
+ * Drops a reference. Unreferenced regions are kept mapped in the LRU list
+ * when a cache budget has been set, otherwise they are unmapped right away.
+ */
+static int kvmi_mem_region_put( struct kvmi_dom *dom, struct kvmi_mem_region *reg )
 {
-	memset( msg, 0, sizeof( *msg ) );
+	if ( --reg->refcount )
+		return 0;
 
-	msg->hdr.id   = KVMI_SET_REGISTERS;
-	msg->hdr.seq  = new_seq();
-	msg->hdr.size = sizeof( *msg ) - sizeof( msg->hdr );
+	if ( !dom->lru_max_regions && !dom->lru_max_bytes )
+		return kvmi_mem_region_free( dom, reg );
 
-	msg->vcpu.vcpu = vcpu;
-	msg->regs      = *regs;
+	list_add_tail( &dom->mem_lru, &reg->lru );
+	dom->lru_regions++;
+	dom->lru_bytes += reg->length;
+
+	kvmi_mem_lru_evict( dom, false );
+
+	return 0;
 }
 
-int kvmi_queue_registers( void *grp, unsigned short vcpu, const struct kvm_regs *regs )
+int kvmi_set_mem_cache_limits( void *d, size_t max_regions, size_t max_bytes )
 {
-	struct kvmi_set_registers_msg msg;
+	struct kvmi_dom *dom = d;
 
-	setup_kvmi_set_registers_msg( &msg, vcpu, regs );
+	pthread_mutex_lock( &dom->mem_lock );
 
-	return kvmi_batch_add( grp, &msg, sizeof( msg ) );
-}
+	dom->lru_max_regions = max_regions;
+	dom->lru_max_bytes   = max_bytes;
 
-int kvmi_set_registers( void *dom, unsigned short vcpu, const struct kvm_regs *regs )
-{
-	struct kvmi_set_registers_msg msg;
+	/* with no budget left, everything unreferenced goes away */
+	kvmi_mem_lru_evict( dom, !max_regions && !max_bytes );
 
-	setup_kvmi_set_registers_msg( &msg, vcpu, regs );
+	pthread_mutex_unlock( &dom->mem_lock );
 
-	return request_raw( dom, &msg, sizeof( msg ), NULL, NULL );
+	return 0;
 }
 
-static void setup_reply_header( struct kvmi_msg_hdr *hdr, unsigned int seq, size_t msg_size )
+/*
+ * Refills the token pool with one write carrying all the KVMI_GET_MAP_TOKEN
+ * requests, followed by the collection of their replies.
+ */
+static int kvmi_refill_map_tokens( struct kvmi_dom *dom )
 {
-	memset( hdr, 0, sizeof( *hdr ) );
+	struct kvmi_msg_hdr hdrs[MAP_TOKEN_POOL];
+	struct iovec        iov = { .iov_base = hdrs, .iov_len = 0 };
+	unsigned int        n   = MAP_TOKEN_POOL - dom->token_count;
+	unsigned int        k;
+	int                 err = 0;
 
-	hdr->id   = KVMI_EVENT_REPLY;
-	hdr->seq  = seq;
-	hdr->size = msg_size;
-}
+	memset( hdrs, 0, sizeof( hdrs ) );
 
-int kvmi_queue_reply_event( void *grp, unsigned int seq, const void *data, size_t data_size )
-{
-	struct kvmi_msg_hdr hdr;
-	size_t              reply_size = sizeof( hdr ) + data_size;
+	for ( k = 0; k < n; k++ ) {
+		hdrs[k].id  = KVMI_GET_MAP_TOKEN;
+		hdrs[k].seq = new_seq();
+	}
 
-	if ( data_size > UINT_MAX ) { /* overflow */
-		errno = E2BIG;
+	iov.iov_len = n * sizeof( hdrs[0] );
+
+	pthread_mutex_lock( &dom->lock );
+
+	if ( do_write( dom, &iov, 1, iov.iov_len ) ) {
+		pthread_mutex_unlock( &dom->lock );
 		return -1;
 	}
 
-	if ( kvmi_batch_check_space( grp, reply_size, 2 ) ) {
-		if ( __kvmi_batch_commit( grp, false ) )
-			return -1;
-		kvmi_batch_reset( grp );
-	}
+	for ( k = 0; k < n; k++ ) {
+		struct kvmi_mem_token *token    = &dom->tokens[dom->token_count];
+		size_t                 received = sizeof( *token );
+		int                    ret;
 
-	setup_reply_header( &hdr, seq, data_size );
+		ret = recv_pipelined_reply( dom, &hdrs[k], token, &received );
+		if ( ret < 0 ) {
+			err = -1;
+			break;
+		}
 
-	if ( __kvmi_batch_add( grp, &hdr, sizeof( hdr ) ) )
-		return -1;
+		if ( ret ) {
+			if ( !err ) {
+				err   = -1;
+				errno = ret;
+			}
+			continue;
+		}
 
-	if ( __kvmi_batch_add( grp, data, data_size ) )
-		return -1;
+		dom->token_count++;
+	}
 
-	( ( struct kvmi_batch * )grp )->wait_for_reply = false;
-	return 0;
+	pthread_mutex_unlock( &dom->lock );
+
+	/* a partial refill is still good enough */
+	return dom->token_count ? 0 : err;
 }
 
-int kvmi_reply_event( void *_dom, unsigned int seq, const void *data, size_t data_size )
+static int kvmi_get_map_token( struct kvmi_dom *dom, struct kvmi_mem_token *token )
 {
-	struct kvmi_dom *   dom = _dom;
-	struct kvmi_msg_hdr hdr;
-	struct iovec        iov[] = {
-                { .iov_base = &hdr, .iov_len = sizeof( hdr ) },
-                { .iov_base = ( void * )data, .iov_len = data_size },
-	};
-	int err;
+	int err = 0;
 
-	setup_reply_header( &hdr, seq, data_size );
+	pthread_mutex_lock( &dom->token_lock );
 
-	pthread_mutex_lock( &dom->lock );
+	if ( !dom->token_count )
+		err = kvmi_refill_map_tokens( dom );
 
-	err = do_write( dom, iov, 2, sizeof( hdr ) + data_size );
+	if ( !err )
+		*token = dom->tokens[--dom->token_count];
 
-	pthread_mutex_unlock( &dom->lock );
+	pthread_mutex_unlock( &dom->token_lock );
 
 	return err;
 }
 
-static int __kvmi_get_version( void *dom, unsigned int *version, struct kvmi_features *supported )
+/*
+ * Tops up the token pool with a single round trip, so that mapping the
+ * regions of a window does not stop for tokens one request at a time.
+ */
+static int kvmi_prefetch_map_tokens( struct kvmi_dom *dom )
 {
-	struct kvmi_get_version_reply rpl;
-	size_t                        received = sizeof( rpl );
-	int                           err;
+	int err = 0;
 
-	err = request( dom, KVMI_GET_VERSION, NULL, 0, &rpl, &received );
+	pthread_mutex_lock( &dom->token_lock );
 
-	if ( !err ) {
-		*version   = rpl.version;
-		*supported = rpl.features;
-	}
+	if ( dom->token_count < MAP_TOKEN_POOL )
+		err = kvmi_refill_map_tokens( dom );
+
+	pthread_mutex_unlock( &dom->token_lock );
 
 	return err;
 }
 
-int kvmi_get_version( void *dom, unsigned int *version )
+static void kvmi_flush_map_tokens( struct kvmi_dom *dom )
 {
-	*version = ( ( struct kvmi_dom * )dom )->api_version;
-
-	return 0;
+	pthread_mutex_lock( &dom->token_lock );
+	dom->token_count = 0;
+	pthread_mutex_unlock( &dom->token_lock );
 }
 
-int kvmi_spp_support( void *dom, bool *supported )
+static void *kvmi_map_physical_page_v2( void *d, unsigned long long int gpa )
 {
-	*supported = ( ( struct kvmi_dom * )dom )->supported.spp;
+	struct kvmi_dom *     dom = d;
+	struct kvmi_mem_token token;
 
-	return 0;
-}
+	struct kvmi_guest_mem_map map_req;
+	struct kvmi_mem_region *  reg;
+	int                       err;
+	void *                    result;
 
-int kvmi_ve_support( void *dom, bool *supported )
-{
-	*supported = ( ( struct kvmi_dom * )dom )->supported.ve;
+	pthread_mutex_lock( &dom->mem_lock );
+again:
+	/* first look-up physical address in region cache */
+	reg = kvmi_mem_cache_lookup_gpa( dom, gpa );
+	if ( reg ) {
+		kvmi_mem_region_get( dom, reg );
+		result = ( char * )reg->virt + ( gpa - reg->start );
+		goto out;
+	}
 
-	return 0;
-}
+	/* take a pre-fetched token, the mapping lock is kept */
+	err = kvmi_get_map_token( dom, &token );
+	if ( err ) {
+		int _errno = errno;
+		pthread_mutex_unlock( &dom->mem_lock );
+		errno = _errno;
+		return MAP_FAILED;
+	}
 
-int kvmi_vmfunc_support( void *dom, bool *supported )
-{
-	*supported = ( ( struct kvmi_dom * )dom )->supported.vmfunc;
+	/* fill request */
+	memset( &map_req, 0, sizeof( struct kvmi_guest_mem_map ) );
+	memcpy( &map_req.token, &token, sizeof( map_req.token ) );
+	map_req.gpa = gpa;
 
-	return 0;
-}
+	/* request region mapping */
+	err = ioctl( dom->mem_fd, KVM_GUEST_MEM_MAP, &map_req );
+	if ( err && errno != EALREADY ) {
+		int _errno = errno;
+		pthread_mutex_unlock( &dom->mem_lock );
+		errno = _errno;
+		return MAP_FAILED;
+	}
+	/* map_req.gpa now contains the starting gpa of the mapped region */
 
-int kvmi_eptp_support( void *dom, bool *supported )
-{
-	*supported = ( ( struct kvmi_dom * )dom )->supported.eptp;
+	/* another thread managed to add the region */
+	if ( err )
+		goto again;
 
-	return 0;
-}
+	result = mmap( NULL, map_req.length, PROT_READ | PROT_WRITE, MAP_SHARED, dom->mem_fd, map_req.gpa );
+	if ( result == MAP_FAILED ) {
+		int _errno = errno;
+		ioctl( dom->mem_fd, KVM_GUEST_MEM_UNMAP, map_req.gpa );
+		pthread_mutex_unlock( &dom->mem_lock );
+		errno = _errno;
+		return MAP_FAILED;
+	}
 
-int kvmi_check_command( void *dom, int id )
-{
-	struct kvmi_check_command req = { .id = id };
+	reg = malloc( sizeof( *reg ) );
+	if ( !reg ) {
+		int _errno = errno;
+		munmap( result, map_req.length );
+		ioctl( dom->mem_fd, KVM_GUEST_MEM_UNMAP, map_req.gpa );
+		pthread_mutex_unlock( &dom->mem_lock );
+		errno = _errno;
+		return MAP_FAILED;
+	}
 
-	return request( dom, KVMI_CHECK_COMMAND, &req, sizeof( req ), NULL, NULL );
-}
+	/* add region to cache */
+	reg->start    = map_req.gpa;
+	reg->length   = map_req.length;
+	reg->virt     = result;
+	reg->refcount = 1;
+	list_add_tail( &dom->mem_cache, &reg->link );
 
-int kvmi_check_event( void *dom, int id )
-{
-	struct kvmi_check_command req = { .id = id };
+	result = ( char * )reg->virt + ( gpa - reg->start );
 
-	return request( dom, KVMI_CHECK_EVENT, &req, sizeof( req ), NULL, NULL );
+out:
+	pthread_mutex_unlock( &dom->mem_lock );
+
+	return result;
 }
 
-int kvmi_control_vm_events( void *dom, int id, bool enable )
+static int kvmi_unmap_physical_page_v2( void *d, void *addr )
 {
-	struct kvmi_control_vm_events req = { .event_id = id, .enable = enable };
+	struct kvmi_dom *       dom = d;
+	struct kvmi_mem_region *reg;
+	int                     err = 0;
 
-	return request( dom, KVMI_CONTROL_VM_EVENTS, &req, sizeof( req ), NULL, NULL );
-}
+	/* validate input address */
+	if ( addr == NULL ) {
+		errno = EINVAL;
+		return -1;
+	}
 
-static int kvmi_read_event_header( struct kvmi_dom *dom, unsigned int *id, unsigned int *size, unsigned int *seq,
-                                   kvmi_timeout_t ms )
-{
-	struct kvmi_msg_hdr h;
+	pthread_mutex_lock( &dom->mem_lock );
 
-	if ( __do_read( dom, &h, sizeof( h ), ms ) )
+	/* look-up region by local virtual address */
+	reg = kvmi_mem_cache_lookup_virt( dom, addr );
+	if ( !reg || !reg->refcount ) {
+		pthread_mutex_unlock( &dom->mem_lock );
+		errno = ENXIO;
 		return -1;
+	}
 
-	*id   = h.id;
-	*seq  = h.seq;
-	*size = h.size;
+	/* dec region reference count & unmap/cache region if unreferenced */
+	err = kvmi_mem_region_put( dom, reg );
 
-	return 0;
+	pthread_mutex_unlock( &dom->mem_lock );
+
+	return err;
 }
 
-static int kvmi_read_event( struct kvmi_dom *dom, kvmi_timeout_t ms )
+static void __kvmi_mem_cache_cleanup( struct kvmi_dom *dom )
 {
-	unsigned int msgid;
-	unsigned int msgsize;
-	unsigned int msgseq;
+	list_t *                i;
+	list_t *                j;
+	struct kvmi_mem_region *reg;
 
-	if ( kvmi_read_event_header( dom, &msgid, &msgsize, &msgseq, ms ) )
-		return -1;
+	/* unmap remaining regions - there should be none left */
+	list_for_each_safe_reverse( i, j, &dom->mem_cache )
+	{
+		reg = list_container( i, struct kvmi_mem_region, link );
 
-	if ( !is_event( msgid ) ) {
-		errno = EINVAL;
-		return -1;
+		munmap( reg->virt, reg->length );
+		if ( dom->mem_remote )
+			ioctl( dom->mem_fd, KVM_GUEST_MEM_UNMAP, reg->start );
+		free( reg );
 	}
 
-	return kvmi_push_event( dom, msgseq, msgsize, ms );
+	INIT_LIST_HEAD( &dom->mem_cache );
+	INIT_LIST_HEAD( &dom->mem_lru );
+	dom->lru_regions = 0;
+	dom->lru_bytes   = 0;
 }
 
-int kvmi_wait_event( void *d, kvmi_timeout_t ms )
+static unsigned long long elapsed_usecs( const struct timespec *start )
 {
-	bool             empty;
-	int              err;
-	struct kvmi_dom *dom = d;
+	struct timespec now;
 
-	/* Don't wait for events if there is one already queued. */
-	pthread_mutex_lock( &dom->event_lock );
-	empty = dom->events == NULL;
-	pthread_mutex_unlock( &dom->event_lock );
+	clock_gettime( CLOCK_MONOTONIC, &now );
+
+	return ( now.tv_sec - start->tv_sec ) * 1000000ULL + now.tv_nsec / 1000 - start->tv_nsec / 1000;
+}
+
+/*
+ * Maps the guest page @gpa over the locked anonymous page at @addr.
+ * While the host is busy, the request is retried with an exponential
+ * backoff starting at MAP_RETRY_MIN_USECS, for at most MAP_RETRY_TIMEOUT_SECS.
+ */
+static int kvmi_map_v1_at( struct kvmi_dom *dom, unsigned long long int gpa, void *addr )
+{
+	struct kvmi_mem_token token;
+	struct kvmi_mem_map   map_req;
+	struct timespec       start;
+	unsigned int          delay  = MAP_RETRY_MIN_USECS;
+	bool                  warned = false;
+	int                   err;
+
+	clock_gettime( CLOCK_MONOTONIC, &start );
+
+	__sync_add_and_fetch( &dom->map_stats.maps, 1 );
+
+	for ( ;; ) {
+		unsigned long long elapsed;
+
+		err = kvmi_get_map_token( dom, &token );
 
-	if ( !empty )
-		return 0;
-	/*
-	 * This ugly code is needed so that we do not block other threads
-	 * that are trying to send commands while we are waiting for events.
-	 */
-	pthread_mutex_lock( &dom->lock );
-	if ( dom->tail - dom->head ) {
-		/*
-		 * The buffer is not empty. As we are shielded by the lock, it
-		 * can be nothing else than an event (complete or partially).
-		 */
-		err = kvmi_read_event( dom, KVMI_NOWAIT );
-		pthread_mutex_unlock( &dom->lock );
-	} else {
-		pthread_mutex_unlock( &dom->lock );
-		/* Wait for events without blocking too much other threads. */
-		err = do_wait( dom, false, ms, true );
 		if ( !err ) {
-			pthread_mutex_lock( &dom->lock );
-			/*
-			 * It is possible that we've lost the chance to read the
-			 * event, someone else might have queued it. So, we don't
-			 * wait at all. We'll get it next time from the queue.
-			 */
-			err = kvmi_read_event( dom, KVMI_NOWAIT );
-			pthread_mutex_unlock( &dom->lock );
+			/* fill IOCTL arg */
+			memcpy( &map_req.token, &token, sizeof( struct kvmi_mem_token ) );
+			map_req.gpa = gpa;
+			map_req.gva = ( __u64 )addr;
+
+			/* do map IOCTL request */
+			err = ioctl( dom->mem_fd, KVM_INTRO_MEM_MAP, &map_req );
+		}
+
+		if ( !err || ( errno != EAGAIN && errno != EBUSY ) )
+			break;
+
+		elapsed = elapsed_usecs( &start );
+		if ( elapsed >= MAP_RETRY_TIMEOUT_SECS * 1000000ULL )
+			break;
+
+		if ( !warned && elapsed >= MAP_RETRY_WARNING_SECS * 1000000ULL ) {
+			kvmi_log_warning( "Slow mapping for gpa %llx", gpa );
+			__sync_add_and_fetch( &dom->map_stats.slow_maps, 1 );
+			warned = true;
+		}
+
+		__sync_add_and_fetch( &dom->map_stats.retries, 1 );
+
+		usleep( delay );
+		delay = MIN( delay * 2, MAP_RETRY_MAX_USECS );
+	}
+
+	if ( err )
+		__sync_add_and_fetch( &dom->map_stats.failures, 1 );
+
+	return err;
+}
+
+static void *kvmi_map_physical_page_v1( void *d, unsigned long long int gpa )
+{
+	struct kvmi_dom *dom = d;
+
+	errno = 0;
+
+	void *addr = mmap( NULL, pagesize, PROT_READ | PROT_WRITE,
+	                   MAP_LOCKED | MAP_POPULATE | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+	if ( addr != MAP_FAILED && kvmi_map_v1_at( dom, gpa, addr ) ) {
+		int _errno = errno;
+		munmap( addr, pagesize );
+		errno = _errno;
+		addr  = MAP_FAILED;
+	}
+
+	return addr;
+}
+
+static int kvmi_unmap_physical_page_v1( void *d, void *addr )
+{
+	const struct kvmi_dom *dom = d;
+	int                    _errno;
+	int                    err;
+
+	/* do unmap IOCTL request */
+	err    = ioctl( dom->mem_fd, KVM_INTRO_MEM_UNMAP, addr );
+	_errno = errno;
+
+	munmap( addr, pagesize );
+
+	errno = _errno;
+
+	return err;
+}
+
+static void *kvmi_map_physical_page_host( void *d, unsigned long long int gpa )
+{
+	struct kvmi_dom *dom = d;
+
+	struct kvmi_mem_region *region;
+	struct kvmi_query_physical req;
+	struct kvmi_query_physical_reply rpl;
+	size_t received = sizeof( rpl );
+	int err;
+
+	pthread_mutex_lock( &dom->mem_lock );
+
+	/* first look-up physical address in region cache */
+	region = kvmi_mem_cache_lookup_gpa( dom, gpa );
+	if ( region ) {
+		kvmi_mem_region_get( dom, region );
+		goto out;
+	}
+
+	region = malloc( sizeof( *region ) );
+	if ( !region ) {
+		pthread_mutex_unlock( &dom->mem_lock );
+		return MAP_FAILED;
+	}
+
+	/* fill request */
+	req.gfn = gpa >> pageshift;
+
+	/* request mem slot */
+	err = request( dom, KVMI_QUERY_PHYSICAL, &req, sizeof( req ), &rpl, &received );
+
+	if ( err ) {
+		free( region );
+		pthread_mutex_unlock( &dom->mem_lock );
+		return MAP_FAILED;
+	}
+
+	region->start  = rpl.gfn << pageshift;
+	region->length = rpl.size * pagesize;
+	region->virt = mmap( NULL, region->length, PROT_READ | PROT_WRITE, MAP_SHARED, dom->mem_fd, region->start );
+	if ( region->virt == MAP_FAILED ) {
+		free( region );
+		pthread_mutex_unlock( &dom->mem_lock );
+		return MAP_FAILED;
+	}
+
+	/* add region to cache */
+	region->refcount = 1;
+	list_add_tail( &dom->mem_cache, &region->link );
+
+out:
+	pthread_mutex_unlock( &dom->mem_lock );
+
+	return ( char * )region->virt + ( gpa - region->start );
+}
+
+static int kvmi_unmap_physical_page_host( void *d, void *addr )
+{
+	struct kvmi_dom *       dom = d;
+	struct kvmi_mem_region *reg;
+	int                     err = 0;
+
+	/* validate input address */
+	if ( addr == NULL ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock( &dom->mem_lock );
+
+	/* look-up region by local virtual address */
+	reg = kvmi_mem_cache_lookup_virt( dom, addr );
+	if ( !reg || !reg->refcount ) {
+		pthread_mutex_unlock( &dom->mem_lock );
+		errno = ENXIO;
+		return -1;
+	}
+
+	/* dec region reference count & unmap/cache region if unreferenced */
+	err = kvmi_mem_region_put( dom, reg );
+
+	pthread_mutex_unlock( &dom->mem_lock );
+
+	return err;
+}
+
+static void *__kvmi_map_physical_page( struct kvmi_dom *dom, unsigned long long int gpa )
+{
+	if ( !dom->mem_remote && dom->mem_fd >= 0 )
+		return kvmi_map_physical_page_host( dom, gpa );
+
+	return mem_v2 ? kvmi_map_physical_page_v2( dom, gpa ) : kvmi_map_physical_page_v1( dom, gpa );
+}
+
+static int __kvmi_unmap_physical_page( struct kvmi_dom *dom, void *addr )
+{
+	if ( !dom->mem_remote && dom->mem_fd >= 0 )
+		return kvmi_unmap_physical_page_host( dom, addr );
+
+	return mem_v2 ? kvmi_unmap_physical_page_v2( dom, addr ) : kvmi_unmap_physical_page_v1( dom, addr );
+}
+
+static bool kvmi_premapped_addr( const struct kvmi_dom *dom, const void *addr )
+{
+	size_t k;
+
+	for ( k = 0; k < dom->premap_count; k++ ) {
+		const struct kvmi_premap_slot *slot = &dom->premap_slots[k];
+
+		if ( addr >= slot->virt && ( const char * )addr < ( char * )slot->virt + slot->length )
+			return true;
+	}
+
+	return false;
+}
+
+static void kvmi_premap_release( struct kvmi_dom *dom )
+{
+	size_t k;
+
+	if ( !dom->premap )
+		return;
+
+	/* drop the reference taken on every slot by kvmi_premap_memslots() */
+	for ( k = 0; k < dom->premap_count; k++ )
+		__kvmi_unmap_physical_page( dom, dom->premap_slots[k].virt );
+
+	free( dom->premap );
+	free( dom->premap_slots );
+
+	dom->premap       = NULL;
+	dom->premap_gfns  = 0;
+	dom->premap_slots = NULL;
+	dom->premap_count = 0;
+}
+
+static bool kvmi_premap_add_slot( struct kvmi_dom *dom, void *virt, size_t length )
+{
+	struct kvmi_premap_slot *slots;
+
+	slots = realloc( dom->premap_slots, ( dom->premap_count + 1 ) * sizeof( *slots ) );
+	if ( !slots )
+		return false;
+
+	slots[dom->premap_count].virt   = virt;
+	slots[dom->premap_count].length = length;
+
+	dom->premap_slots = slots;
+	dom->premap_count++;
+
+	return true;
+}
+
+/* the errors reported for a gpa not backed by any memory slot */
+static bool memory_hole( int err )
+{
+	return err == ENOENT || err == EINVAL || err == EFAULT;
+}
+
+/*
+ * The next gfn to probe after a hole. The first megabyte is probed page
+ * by page (small ROM/RAM slots live there), the rest at 2MB boundaries,
+ * so that a 1GB PCI hole costs 512 failed requests instead of 262144.
+ * A slot starting inside a 2MB block of a hole is missed (not premapped,
+ * but still mapped on demand by kvmi_map_physical_page()).
+ */
+static unsigned long long skip_memory_hole( unsigned long long gfn )
+{
+	unsigned long long block = ( 2ULL << 20 ) >> pageshift;
+
+	if ( gfn < ( ( 1ULL << 20 ) >> pageshift ) )
+		return gfn + 1;
+
+	return ( gfn + block ) & ~( block - 1 );
+}
+
+/*
+ * Walks the guest physical space and maps every memory slot once. The gaps
+ * between slots are skipped with skip_memory_hole() and any other error
+ * stops the walk.
+ */
+static int kvmi_premap_memslots( struct kvmi_dom *dom )
+{
+	unsigned long long max_gfn, gfn;
+
+	if ( kvmi_get_maximum_gfn( dom, &max_gfn ) )
+		return -1;
+
+	dom->premap = calloc( max_gfn + 1, sizeof( *dom->premap ) );
+	if ( !dom->premap )
+		return -1;
+
+	dom->premap_gfns = max_gfn + 1;
+
+	for ( gfn = 0; gfn <= max_gfn; ) {
+		unsigned long long      gpa = gfn << pageshift;
+		struct kvmi_mem_region *reg;
+		unsigned long long      end, k;
+		void *                  virt;
+
+		virt = __kvmi_map_physical_page( dom, gpa );
+		if ( virt == MAP_FAILED ) {
+			if ( dom->disconnected || !memory_hole( errno ) )
+				return -1;
+			gfn = skip_memory_hole( gfn );
+			continue;
+		}
+
+		pthread_mutex_lock( &dom->mem_lock );
+		reg = kvmi_mem_cache_lookup_virt( dom, virt );
+		pthread_mutex_unlock( &dom->mem_lock );
+
+		if ( !reg || !kvmi_premap_add_slot( dom, reg->virt, reg->length ) ) {
+			__kvmi_unmap_physical_page( dom, virt );
+			errno = ENOMEM;
+			return -1;
 		}
+
+		end = ( reg->start + reg->length ) >> pageshift;
+		for ( k = reg->start >> pageshift; k < end && k <= max_gfn; k++ )
+			dom->premap[k] = ( char * )reg->virt + ( ( k << pageshift ) - reg->start );
+
+		gfn = end > gfn ? end : gfn + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Maps all guest memory slots and builds a gfn-indexed table so that
+ * kvmi_map_physical_page() becomes a plain lookup. Calling it again while
+ * enabled rebuilds the table (eg. after the memory slots have changed).
+ * The caller must ensure that no other thread is using the mapped memory
+ * while the table is rebuilt or released.
+ */
+int kvmi_memory_premap( void *d, bool enable )
+{
+	struct kvmi_dom *dom = d;
+	int              err;
+
+	kvmi_premap_release( dom );
+
+	if ( !enable )
+		return 0;
+
+	if ( dom->mem_fd < 0 ) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	if ( dom->mem_remote && !mem_v2 ) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	err = kvmi_premap_memslots( dom );
+	if ( err ) {
+		int _errno = errno;
+
+		kvmi_premap_release( dom );
+		errno = _errno;
+	}
+
+	return err;
+}
+
+void *kvmi_map_physical_page( void *d, unsigned long long int gpa )
+{
+	struct kvmi_dom *  dom = d;
+	unsigned long long gfn = gpa >> pageshift;
+
+	if ( dom->premap && gfn < dom->premap_gfns && dom->premap[gfn] )
+		return ( char * )dom->premap[gfn] + ( gpa & ( pagesize - 1 ) );
+
+	return __kvmi_map_physical_page( dom, gpa );
+}
+
+int kvmi_unmap_physical_page( void *d, void *addr )
+{
+	struct kvmi_dom *dom = d;
+
+	if ( dom->premap && kvmi_premapped_addr( dom, addr ) )
+		return 0;
+
+	return __kvmi_unmap_physical_page( dom, addr );
+}
+
+static void kvmi_mem_window_free( struct kvmi_dom *dom, struct kvmi_mem_window *win )
+{
+	size_t k;
+
+	for ( k = 0; k < win->ref_count; k++ ) {
+		if ( dom->mem_remote && !mem_v2 )
+			ioctl( dom->mem_fd, KVM_INTRO_MEM_UNMAP, win->refs[k] );
+		else
+			__kvmi_unmap_physical_page( dom, win->refs[k] );
+	}
+
+	munmap( win->virt, win->length );
+	free( win->refs );
+	free( win );
+}
+
+static void kvmi_mem_windows_release( struct kvmi_dom *dom )
+{
+	list_t *i;
+	list_t *j;
+
+	list_for_each_safe( i, j, &dom->mem_windows )
+	{
+		struct kvmi_mem_window *win = list_container( i, struct kvmi_mem_window, link );
+
+		list_del( &win->link );
+		kvmi_mem_window_free( dom, win );
+	}
+
+	INIT_LIST_HEAD( &dom->mem_windows );
+}
+
+/* remote mapping v1: every guest page is injected into the locked window */
+static int kvmi_mem_window_fill_v1( struct kvmi_dom *dom, struct kvmi_mem_window *win, unsigned long long gpa )
+{
+	size_t off;
+
+	for ( off = 0; off < win->length; off += pagesize ) {
+		void *addr = ( char * )win->virt + off;
+
+		if ( kvmi_map_v1_at( dom, gpa + off, addr ) )
+			return -1;
+
+		win->refs[win->ref_count++] = addr;
+	}
+
+	return 0;
+}
+
+/*
+ * Every backing region is referenced through the region cache and the
+ * needed part of its (shared) mapping is duplicated into the window.
+ */
+static int kvmi_mem_window_fill( struct kvmi_dom *dom, struct kvmi_mem_window *win, unsigned long long gpa )
+{
+	size_t off = 0;
+
+	while ( off < win->length ) {
+		struct kvmi_mem_region *reg;
+		size_t                  piece;
+		char *                  src;
+
+		src = __kvmi_map_physical_page( dom, gpa + off );
+		if ( src == MAP_FAILED )
+			return -1;
+
+		win->refs[win->ref_count++] = src;
+
+		pthread_mutex_lock( &dom->mem_lock );
+		reg   = kvmi_mem_cache_lookup_virt( dom, src );
+		piece = reg ? ( size_t )( ( char * )reg->virt + reg->length - src ) : ( size_t )pagesize;
+		pthread_mutex_unlock( &dom->mem_lock );
+
+		piece = MIN( piece, win->length - off );
+
+		if ( mremap( src, 0, piece, MREMAP_MAYMOVE | MREMAP_FIXED, ( char * )win->virt + off ) == MAP_FAILED )
+			return -1;
+
+		off += piece;
+	}
+
+	return 0;
+}
+
+/*
+ * Maps [gpa, gpa + size) into a single contiguous virtual window, no matter
+ * how many memory regions back it. The window must be released with
+ * kvmi_unmap_physical_range().
+ */
+void *kvmi_map_physical_range( void *d, unsigned long long int gpa, size_t size )
+{
+	struct kvmi_dom *       dom    = d;
+	unsigned long long      offset = gpa & ( pagesize - 1 );
+	struct kvmi_mem_window *win;
+	int                     flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	int                     prot  = PROT_NONE;
+	int                     err;
+
+	if ( !size || dom->mem_fd < 0 ) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
+	win = calloc( 1, sizeof( *win ) );
+	if ( !win )
+		return MAP_FAILED;
+
+	win->length = ( offset + size + pagesize - 1 ) & ~( ( size_t )pagesize - 1 );
+
+	win->refs = calloc( win->length >> pageshift, sizeof( *win->refs ) );
+	if ( !win->refs ) {
+		free( win );
+		return MAP_FAILED;
+	}
+
+	if ( dom->mem_remote && !mem_v2 ) {
+		prot = PROT_READ | PROT_WRITE;
+		flags |= MAP_LOCKED | MAP_POPULATE;
+		flags &= ~MAP_NORESERVE;
+	}
+
+	win->virt = mmap( NULL, win->length, prot, flags, -1, 0 );
+	if ( win->virt == MAP_FAILED ) {
+		free( win->refs );
+		free( win );
+		return MAP_FAILED;
+	}
+
+	gpa -= offset;
+
+	/* the host mapping path queries the slots instead of using tokens */
+	err = dom->mem_remote ? kvmi_prefetch_map_tokens( dom ) : 0;
+	if ( !err ) {
+		if ( dom->mem_remote && !mem_v2 )
+			err = kvmi_mem_window_fill_v1( dom, win, gpa );
+		else
+			err = kvmi_mem_window_fill( dom, win, gpa );
+	}
+
+	if ( err ) {
+		int _errno = errno;
+
+		kvmi_mem_window_free( dom, win );
+		errno = _errno;
+		return MAP_FAILED;
+	}
+
+	pthread_mutex_lock( &dom->mem_lock );
+	list_add_tail( &dom->mem_windows, &win->link );
+	pthread_mutex_unlock( &dom->mem_lock );
+
+	return ( char * )win->virt + offset;
+}
+
+int kvmi_unmap_physical_range( void *d, void *addr )
+{
+	struct kvmi_dom *       dom = d;
+	struct kvmi_mem_window *win = NULL;
+	list_t *                i;
+
+	pthread_mutex_lock( &dom->mem_lock );
+
+	list_for_each( i, &dom->mem_windows )
+	{
+		struct kvmi_mem_window *w = list_container( i, struct kvmi_mem_window, link );
+
+		if ( addr >= w->virt && ( char * )addr < ( char * )w->virt + w->length ) {
+			list_del( &w->link );
+			win = w;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock( &dom->mem_lock );
+
+	if ( !win ) {
+		errno = ENXIO;
+		return -1;
+	}
+
+	kvmi_mem_window_free( dom, win );
+
+	return 0;
+}
+
+struct kvmi_map_request {
+	unsigned long long int gpa;
+	kvmi_map_cb            cb;
+	void *                 ctx;
+
+	list_t link;
+};
+
+static void *map_worker( void *_dom )
+{
+	struct kvmi_dom *dom = _dom;
+
+	pthread_mutex_lock( &dom->map_lock );
+
+	for ( ;; ) {
+		struct kvmi_map_request *req;
+		void *                   addr;
+		int                      err = 0;
+
+		while ( !dom->map_th_stop && list_is_empty( &dom->map_queue ) )
+			pthread_cond_wait( &dom->map_cond, &dom->map_lock );
+
+		if ( dom->map_th_stop )
+			break;
+
+		req = list_container( list_remove_head( &dom->map_queue ), struct kvmi_map_request, link );
+
+		pthread_mutex_unlock( &dom->map_lock );
+
+		addr = kvmi_map_physical_page( dom, req->gpa );
+		if ( addr == MAP_FAILED )
+			err = errno ? errno : EFAULT;
+
+		req->cb( dom, req->gpa, addr, err, req->ctx );
+		free( req );
+
+		pthread_mutex_lock( &dom->map_lock );
+	}
+
+	pthread_mutex_unlock( &dom->map_lock );
+
+	return NULL;
+}
+
+static void kvmi_stop_map_worker( struct kvmi_dom *dom )
+{
+	list_t *i;
+	list_t *j;
+
+	pthread_mutex_lock( &dom->map_lock );
+	dom->map_th_stop = true;
+	pthread_cond_signal( &dom->map_cond );
+	pthread_mutex_unlock( &dom->map_lock );
+
+	if ( dom->map_th_started ) {
+		pthread_join( dom->map_th_id, NULL );
+		dom->map_th_started = false;
+	}
+
+	/* the requests that never made it are cancelled */
+	list_for_each_safe( i, j, &dom->map_queue )
+	{
+		struct kvmi_map_request *req = list_container( i, struct kvmi_map_request, link );
+
+		list_del( &req->link );
+		req->cb( dom, req->gpa, MAP_FAILED, ECANCELED, req->ctx );
+		free( req );
+	}
+}
+
+/*
+ * Maps @gpa from a per-domain worker thread and reports the result through
+ * @cb (also called from the worker thread). This way, the caller is not
+ * blocked while a slow mapping is retried.
+ */
+int kvmi_map_physical_page_async( void *d, unsigned long long int gpa, kvmi_map_cb cb, void *ctx )
+{
+	struct kvmi_dom *        dom = d;
+	struct kvmi_map_request *req;
+	int                      err = 0;
+
+	if ( !cb ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	req = calloc( 1, sizeof( *req ) );
+	if ( !req )
+		return -1;
+
+	req->gpa = gpa;
+	req->cb  = cb;
+	req->ctx = ctx;
+
+	pthread_mutex_lock( &dom->map_lock );
+
+	if ( dom->map_th_stop ) {
+		errno = ESHUTDOWN;
+		err   = -1;
+	} else if ( !dom->map_th_started ) {
+		err = pthread_create( &dom->map_th_id, NULL, map_worker, dom );
+		if ( err ) {
+			errno = err;
+			err   = -1;
+		} else
+			dom->map_th_started = true;
+	}
+
+	if ( !err ) {
+		list_add_tail( &dom->map_queue, &req->link );
+		pthread_cond_signal( &dom->map_cond );
+	}
+
+	pthread_mutex_unlock( &dom->map_lock );
+
+	if ( err )
+		free( req );
+
+	return err;
+}
+
+int kvmi_get_map_stats( void *d, struct kvmi_map_stats *stats )
+{
+	struct kvmi_dom *dom = d;
+
+	stats->maps      = __sync_add_and_fetch( &dom->map_stats.maps, 0 );
+	stats->retries   = __sync_add_and_fetch( &dom->map_stats.retries, 0 );
+	stats->slow_maps = __sync_add_and_fetch( &dom->map_stats.slow_maps, 0 );
+	stats->failures  = __sync_add_and_fetch( &dom->map_stats.failures, 0 );
+
+	return 0;
+}
+
+static void *alloc_get_registers_req( unsigned short vcpu, struct kvm_msrs *msrs, size_t *req_size )
+{
+	struct {
+		struct kvmi_vcpu_hdr      vcpu;
+		struct kvmi_get_registers regs;
+	} * req;
+
+	*req_size = sizeof( *req ) + sizeof( __u32 ) * msrs->nmsrs;
+	req       = calloc( 1, *req_size );
+
+	if ( req ) {
+		unsigned int k = 0;
+
+		req->vcpu.vcpu  = vcpu;
+		req->regs.nmsrs = msrs->nmsrs;
+
+		for ( ; k < msrs->nmsrs; k++ )
+			req->regs.msrs_idx[k] = msrs->entries[k].index;
+	}
+
+	return req;
+}
+
+static int process_get_registers_reply( struct kvmi_dom *dom, size_t received, struct kvm_regs *regs,
+                                        struct kvm_sregs *sregs, struct kvm_msrs *msrs, unsigned int *mode )
+{
+	struct kvmi_get_registers_reply rpl;
+
+	if ( received != sizeof( rpl ) + sizeof( struct kvm_msr_entry ) * msrs->nmsrs ) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	if ( do_read( dom, &rpl, sizeof( rpl ) ) )
+		return -1;
+
+	if ( do_read( dom, &msrs->entries, sizeof( struct kvm_msr_entry ) * msrs->nmsrs ) )
+		return -1;
+
+	memcpy( regs, &rpl.regs, sizeof( *regs ) );
+	memcpy( sregs, &rpl.sregs, sizeof( *sregs ) );
+	*mode = rpl.mode;
+
+	return 0;
+}
+
+int kvmi_get_registers( void *d, unsigned short vcpu, struct kvm_regs *regs, struct kvm_sregs *sregs,
+                        struct kvm_msrs *msrs, unsigned int *mode )
+{
+	struct kvmi_dom *dom = d;
+	void *           req;
+	size_t           req_size;
+	size_t           received;
+	int              err = -1;
+
+	req = alloc_get_registers_req( vcpu, msrs, &req_size );
+
+	if ( !req )
+		return -1;
+
+	pthread_mutex_lock( &dom->lock );
+
+	err = request_varlen_response( dom, KVMI_GET_REGISTERS, req, req_size, &received );
+
+	if ( !err )
+		err = process_get_registers_reply( dom, received, regs, sregs, msrs, mode );
+
+	pthread_mutex_unlock( &dom->lock );
+
+	free( req );
+
+	return err;
+}
+
+static void setup_kvmi_set_registers_msg( struct kvmi_set_registers_msg *msg, unsigned short vcpu,
+                                          const struct kvm_regs *regs )
+{
+	memset( msg, 0, sizeof( *msg ) );
+
+	msg->hdr.id   = KVMI_SET_REGISTERS;
+	msg->hdr.seq  = new_seq();
+	msg->hdr.size = sizeof( *msg ) - sizeof( msg->hdr );
+
+	msg->vcpu.vcpu = vcpu;
+	msg->regs      = *regs;
+}
+
+int kvmi_queue_registers( void *grp, unsigned short vcpu, const struct kvm_regs *regs )
+{
+	struct kvmi_set_registers_msg msg;
+
+	setup_kvmi_set_registers_msg( &msg, vcpu, regs );
+
+	return kvmi_batch_add( grp, &msg, sizeof( msg ) );
+}
+
+int kvmi_set_registers( void *dom, unsigned short vcpu, const struct kvm_regs *regs )
+{
+	struct kvmi_set_registers_msg msg;
+
+	setup_kvmi_set_registers_msg( &msg, vcpu, regs );
+
+	return request_raw( dom, &msg, sizeof( msg ), NULL, NULL );
+}
+
+static void setup_reply_header( struct kvmi_msg_hdr *hdr, unsigned int seq, size_t msg_size )
+{
+	memset( hdr, 0, sizeof( *hdr ) );
+
+	hdr->id   = KVMI_EVENT_REPLY;
+	hdr->seq  = seq;
+	hdr->size = msg_size;
+}
+
+int kvmi_queue_reply_event( void *grp, unsigned int seq, const void *data, size_t data_size )
+{
+	struct kvmi_msg_hdr hdr;
+	size_t              reply_size = sizeof( hdr ) + data_size;
+
+	if ( data_size > UINT_MAX ) { /* overflow */
+		errno = E2BIG;
+		return -1;
+	}
+
+	if ( kvmi_batch_check_space( grp, reply_size, 2 ) ) {
+		if ( __kvmi_batch_commit( grp, false ) )
+			return -1;
+		kvmi_batch_reset( grp );
+	}
+
+	setup_reply_header( &hdr, seq, data_size );
+
+	if ( __kvmi_batch_add( grp, &hdr, sizeof( hdr ) ) )
+		return -1;
+
+	if ( __kvmi_batch_add( grp, data, data_size ) )
+		return -1;
+
+	( ( struct kvmi_batch * )grp )->wait_for_reply = false;
+	return 0;
+}
+
+int kvmi_reply_event( void *_dom, unsigned int seq, const void *data, size_t data_size )
+{
+	struct kvmi_dom *   dom = _dom;
+	struct kvmi_msg_hdr hdr;
+	struct iovec        iov[] = {
+                { .iov_base = &hdr, .iov_len = sizeof( hdr ) },
+                { .iov_base = ( void * )data, .iov_len = data_size },
+	};
+	int err;
+
+	setup_reply_header( &hdr, seq, data_size );
+
+	pthread_mutex_lock( &dom->lock );
+
+	err = do_write( dom, iov, 2, sizeof( hdr ) + data_size );
+
+	pthread_mutex_unlock( &dom->lock );
+
+	return err;
+}
+
+static int __kvmi_get_version( void *dom, unsigned int *version, struct kvmi_features *supported )
+{
+	struct kvmi_get_version_reply rpl;
+	size_t                        received = sizeof( rpl );
+	int                           err;
+
+	err = request( dom, KVMI_GET_VERSION, NULL, 0, &rpl, &received );
+
+	if ( !err ) {
+		*version   = rpl.version;
+		*supported = rpl.features;
+	}
+
+	return err;
+}
+
+int kvmi_get_version( void *dom, unsigned int *version )
+{
+	*version = ( ( struct kvmi_dom * )dom )->api_version;
+
+	return 0;
+}
+
+int kvmi_spp_support( void *dom, bool *supported )
+{
+	*supported = ( ( struct kvmi_dom * )dom )->supported.spp;
+
+	return 0;
+}
+
+int kvmi_ve_support( void *dom, bool *supported )
+{
+	*supported = ( ( struct kvmi_dom * )dom )->supported.ve;
+
+	return 0;
+}
+
+int kvmi_vmfunc_support( void *dom, bool *supported )
+{
+	*supported = ( ( struct kvmi_dom * )dom )->supported.vmfunc;
+
+	return 0;
+}
+
+int kvmi_eptp_support( void *dom, bool *supported )
+{
+	*supported = ( ( struct kvmi_dom * )dom )->supported.eptp;
+
+	return 0;
+}
+
+int kvmi_check_command( void *dom, int id )
+{
+	struct kvmi_check_command req = { .id = id };
+
+	return request( dom, KVMI_CHECK_COMMAND, &req, sizeof( req ), NULL, NULL );
+}
+
+int kvmi_check_event( void *dom, int id )
+{
+	struct kvmi_check_command req = { .id = id };
+
+	return request( dom, KVMI_CHECK_EVENT, &req, sizeof( req ), NULL, NULL );
+}
+
+int kvmi_control_vm_events( void *dom, int id, bool enable )
+{
+	struct kvmi_control_vm_events req = { .event_id = id, .enable = enable };
+
+	return request( dom, KVMI_CONTROL_VM_EVENTS, &req, sizeof( req ), NULL, NULL );
+}
+
+static int kvmi_read_event_header( struct kvmi_dom *dom, unsigned int *id, unsigned int *size, unsigned int *seq,
+                                   kvmi_timeout_t ms )
+{
+	struct kvmi_msg_hdr h;
+
+	if ( __do_read( dom, &h, sizeof( h ), ms ) )
+		return -1;
+
+	*id   = h.id;
+	*seq  = h.seq;
+	*size = h.size;
+
+	return 0;
+}
+
+static int kvmi_read_event( struct kvmi_dom *dom, kvmi_timeout_t ms )
+{
+	unsigned int msgid;
+	unsigned int msgsize;
+	unsigned int msgseq;
+
+	if ( kvmi_read_event_header( dom, &msgid, &msgsize, &msgseq, ms ) )
+		return -1;
+
+	if ( !is_event( msgid ) ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return kvmi_push_event( dom, msgseq, msgsize, ms );
+}
+
+int kvmi_wait_event( void *d, kvmi_timeout_t ms )
+{
+	bool             empty;
+	int              err;
+	struct kvmi_dom *dom = d;
+
+	/* Don't wait for events if there is one already queued. */
+	pthread_mutex_lock( &dom->event_lock );
+	empty = dom->events == NULL;
+	pthread_mutex_unlock( &dom->event_lock );
+
+	if ( !empty )
+		return 0;
+	/*
+	 * This ugly code is needed so that we do not block other threads
+	 * that are trying to send commands while we are waiting for events.
+	 */
+	pthread_mutex_lock( &dom->lock );
+	if ( dom->tail - dom->head ) {
+		/*
+		 * The buffer is not empty. As we are shielded by the lock, it
+		 * can be nothing else than an event (complete or partially).
+		 */
+		err = kvmi_read_event( dom, KVMI_NOWAIT );
+		pthread_mutex_unlock( &dom->lock );
+	} else {
+		pthread_mutex_unlock( &dom->lock );
+		/* Wait for events without blocking too much other threads. */
+		err = do_wait( dom, false, ms, true );
+		if ( !err ) {
+			pthread_mutex_lock( &dom->lock );
+			/*
+			 * It is possible that we've lost the chance to read the
+			 * event, someone else might have queued it. So, we don't
+			 * wait at all. We'll get it next time from the queue.
+			 */
+			err = kvmi_read_event( dom, KVMI_NOWAIT );
+			pthread_mutex_unlock( &dom->lock );
+		}
+	}
+
+	return err;
+}
+
+void kvmi_set_log_cb( kvmi_log_cb cb, void *ctx )
+{
+	log_cb  = cb;
+	log_ctx = ctx;
+}
+
+int kvmi_get_maximum_gfn( void *dom, unsigned long long *gfn )
+{
+	struct kvmi_get_max_gfn_reply rpl;
+	size_t                        received = sizeof( rpl );
+	int                           err;
+
+	err = request( dom, KVMI_GET_MAX_GFN, NULL, 0, &rpl, &received );
+	if ( !err )
+		*gfn = rpl.gfn;
+
+	return err;
+}
+
+int kvmi_get_next_available_gfn( void *dom, unsigned long long *gfn )
+{
+	struct kvmi_get_next_available_gfn_reply rpl;
+	size_t                                   received = sizeof( rpl );
+	int                                      err;
+
+	err = request( dom, KVMI_GET_NEXT_AVAILABLE_GFN, NULL, 0, &rpl, &received );
+	if ( !err )
+		*gfn = rpl.gfn;
+
+	return err;
+}
+
+/* begin of VE related functions */
+int kvmi_set_ve_info_page( void *dom, unsigned short vcpu, unsigned long long int gpa )
+{
+	struct {
+		struct kvmi_vcpu_hdr         hdr;
+		struct kvmi_set_ve_info_page cmd;
+	} req = { .hdr = { .vcpu = vcpu }, .cmd = { .gpa = gpa } };
+
+	return request( dom, KVMI_SET_VE_INFO_PAGE, &req, sizeof( req ), NULL, 0 );
+}
+
+int kvmi_switch_ept_view( void *dom, unsigned short vcpu, unsigned short view )
+{
+	struct {
+		struct kvmi_vcpu_hdr            hdr;
+		struct kvmi_switch_ept_view_req cmd;
+	} req = { .hdr = { .vcpu = vcpu }, .cmd = { .view = view } };
+	int err;
+
+	err = request( dom, KVMI_SWITCH_EPT_VIEW, &req, sizeof( req ), NULL, 0 );
+	kvmi_views_set_vcpu( dom, vcpu, view, !err );
+
+	return err;
+}
+
+int kvmi_disable_ve( void *dom, unsigned short vcpu )
+{
+	struct kvmi_vcpu_hdr req = { .vcpu = vcpu };
+
+	return request( dom, KVMI_DISABLE_VE, &req, sizeof( req ), NULL, 0 );
+}
+
+/*
+ * The protocol has no payload defined for KVMI_CONTROL_VE, so this goes
+ * through KVMI_SET_VE_INFO_PAGE and KVMI_DISABLE_VE.
+ */
+int kvmi_control_ve( void *dom, unsigned short vcpu, unsigned long long int gpa, bool enable )
+{
+	if ( enable )
+		return kvmi_set_ve_info_page( dom, vcpu, gpa );
+
+	return kvmi_disable_ve( dom, vcpu );
+}
+
+/*
+ * Sets or clears the suppress-#VE bit of the given pages in a view. The
+ * bit is part of the page access, so the current rights are read first
+ * (with pipelined queries) and written back with the new bit, in one
+ * batch. A concurrent change of the rights of these pages may be lost.
+ */
+int kvmi_set_ept_pages_conv( void *dom, unsigned short view, const unsigned long long *gpa, size_t count, bool sve )
+{
+	unsigned char *access;
+	void *         grp = NULL;
+	size_t         k;
+	int            err = -1;
+
+	if ( !count )
+		return 0;
+
+	access = malloc( count );
+	if ( !access )
+		return -1;
+
+	if ( kvmi_get_page_access( dom, gpa, access, count, view ) )
+		goto out;
+
+	for ( k = 0; k < count; k++ )
+		access[k] = ( access[k] & ~KVMI_PAGE_ACCESS_SVE ) | ( sve ? KVMI_PAGE_ACCESS_SVE : 0 );
+
+	grp = kvmi_batch_alloc( dom );
+	if ( !grp )
+		goto out;
+
+	for ( k = 0; k < count; k += PAGE_ACCESS_MAX_ENTRIES ) {
+		unsigned short n = MIN( count - k, PAGE_ACCESS_MAX_ENTRIES );
+
+		if ( kvmi_queue_page_access( grp, ( unsigned long long * )gpa + k, access + k, n, view ) )
+			goto out;
+	}
+
+	if ( kvmi_batch_commit( grp ) )
+		goto out;
+
+	kvmi_shadow_update( dom, view, gpa, access, count, true );
+
+	err = 0;
+out:
+	kvmi_batch_free( grp );
+	free( access );
+
+	return err;
+}
+
+int kvmi_set_ept_page_conv( void *dom, unsigned short index, unsigned long long gpa, bool sve )
+{
+	return kvmi_set_ept_pages_conv( dom, index, &gpa, 1, sve );
+}
+
+int kvmi_get_ept_page_conv( void *dom, unsigned short index, unsigned long long gpa, bool *sve )
+{
+	unsigned char access;
+
+	if ( kvmi_get_page_access( dom, &gpa, &access, 1, index ) )
+		return -1;
+
+	*sve = access & KVMI_PAGE_ACCESS_SVE;
+
+	return 0;
+}
+
+/*
+ * The view is cached from the previous switches, queries and events. The
+ * guest can switch (with VMFUNC) only to the views made visible to the
+ * vCPU, so the cache is used only while kvmi_control_ept_view() has left
+ * none visible; otherwise the host is asked every time.
+ */
+int kvmi_get_ept_view( void *dom, unsigned short vcpu, unsigned short *view )
+{
+	struct kvmi_vcpu_hdr           req = { .vcpu = vcpu };
+	struct kvmi_get_ept_view_reply rpl;
+	int                            err;
+	size_t                         received = sizeof( rpl );
+
+	if ( kvmi_views_get_vcpu( dom, vcpu, view ) )
+		return 0;
+
+	err = request( dom, KVMI_GET_EPT_VIEW, &req, sizeof( req ), &rpl, &received );
+	if ( !err ) {
+		*view = rpl.view;
+		kvmi_views_set_vcpu( dom, vcpu, rpl.view, true );
+	}
+
+	return err;
+}
+
+int kvmi_control_ept_view( void *dom, unsigned short vcpu, unsigned short view, bool visible )
+{
+	struct {
+		struct kvmi_vcpu_hdr             hdr;
+		struct kvmi_control_ept_view_req cmd;
+	} req = { .hdr = { .vcpu = vcpu }, .cmd = { .view = view, .visible = visible } };
+	int err;
+
+	err = request( dom, KVMI_CONTROL_EPT_VIEW, &req, sizeof( req ), NULL, 0 );
+	if ( !err )
+		kvmi_views_set_visible( dom, vcpu, view, visible );
+
+	return err;
+}
+/* end of VE related functions */
+
+int kvmi_control_singlestep( void *dom, unsigned short vcpu, bool enable )
+{
+	struct {
+		struct kvmi_vcpu_hdr                vcpu;
+		struct kvmi_vcpu_control_singlestep cmd;
+	} req = { .vcpu = { .vcpu = vcpu }, .cmd = { .enable = enable } };
+
+	return request( dom, KVMI_VCPU_CONTROL_SINGLESTEP, &req, sizeof( req ), NULL, NULL );
+}
+
+int kvmi_get_xcr( void *dom, unsigned short vcpu, __u8 xcr, __u64 *value )
+{
+	struct {
+		struct kvmi_vcpu_hdr     hdr;
+		struct kvmi_vcpu_get_xcr cmd;
+	} req = { .hdr = { .vcpu = vcpu }, .cmd = { .xcr = xcr } };
+	struct kvmi_vcpu_get_xcr_reply rpl;
+	int                            err;
+	size_t                         received = sizeof( rpl );
+
+	err = request( dom, KVMI_VCPU_GET_XCR, &req, sizeof( req ), &rpl, &received );
+	if ( !err )
+		*value = rpl.value;
+
+	return err;
+}
+
+int kvmi_set_xsave( void *dom, unsigned short vcpu, const void *buffer, size_t size )
+{
+	struct kvmi_msg_hdr  hdr;
+	struct kvmi_vcpu_hdr vcpu_hdr;
+	struct iovec         iov[]    = {
+                { .iov_base = &hdr, .iov_len = sizeof( hdr ) },
+                { .iov_base = &vcpu_hdr, .iov_len = sizeof( vcpu_hdr ) },
+                { .iov_base = ( void * )buffer, .iov_len = size },
+	};
+	size_t n          = sizeof( iov ) / sizeof( iov[0] );
+	size_t total_size = sizeof( hdr ) + sizeof( vcpu_hdr ) + size;
+
+	memset( &hdr, 0, sizeof( hdr ) );
+
+	hdr.id   = KVMI_VCPU_SET_XSAVE;
+	hdr.seq  = new_seq();
+	hdr.size = total_size - sizeof( hdr );
+
+	memset( &vcpu_hdr, 0, sizeof( vcpu_hdr ) );
+
+	vcpu_hdr.vcpu = vcpu;
+
+	return request_iov( dom, iov, n, total_size, NULL, NULL );
+}
+
+static const unsigned int tlb_shifts[] = { X86_PAGE_SHIFT, 21, 30 };
+
+/*
+ * Set for the translations that came from KVMI_VCPU_TRANSLATE_GVA: the
+ * gpa is right, but the access rights and the real page size are not
+ * known, so kvmi_walk_gva() does not use them.
+ */
+#define TLB_RIGHTS_UNKNOWN ( 1U << 31 )
+
+static struct kvmi_tlb_entry *kvmi_tlb_slot( struct kvmi_dom *dom, __u64 cr3, __u64 page, unsigned int shift )
+{
+	__u64 hash = ( ( cr3 >> X86_PAGE_SHIFT ) * 0x9e3779b97f4a7c15ULL ) ^ ( page * 0xc2b2ae3d27d4eb4fULL ) ^ shift;
+
+	return &dom->tlb[( hash ^ ( hash >> 29 ) ) & ( dom->tlb_size - 1 )];
+}
+
+/* the entries without known rights are used only by the callers that accept them */
+static bool kvmi_tlb_lookup( struct kvmi_dom *dom, __u64 cr3, __u64 gva, __u64 *gpa, __u64 *page_size,
+                             unsigned int *flags, bool accept_unknown )
+{
+	bool   found = false;
+	size_t k;
+
+	pthread_mutex_lock( &dom->tlb_lock );
+
+	if ( !dom->tlb )
+		goto out;
+
+	for ( k = 0; k < sizeof( tlb_shifts ) / sizeof( tlb_shifts[0] ); k++ ) {
+		unsigned int           shift = tlb_shifts[k];
+		struct kvmi_tlb_entry *e     = kvmi_tlb_slot( dom, cr3, gva >> shift, shift );
+
+		if ( e->shift == shift && e->cr3 == cr3 && e->page == gva >> shift
+		     && ( accept_unknown || !( e->flags & TLB_RIGHTS_UNKNOWN ) ) ) {
+			*gpa = e->gpa | ( gva & ( ( 1ULL << shift ) - 1 ) );
+			if ( page_size )
+				*page_size = 1ULL << shift;
+			if ( flags )
+				*flags = e->flags;
+			found = true;
+			break;
+		}
+	}
+
+	if ( found )
+		dom->tlb_hits++;
+	else
+		dom->tlb_misses++;
+
+out:
+	pthread_mutex_unlock( &dom->tlb_lock );
+
+	return found;
+}
+
+static void kvmi_tlb_insert( struct kvmi_dom *dom, __u64 cr3, __u64 gva, __u64 gpa, __u64 page_size,
+                             unsigned int flags )
+{
+	unsigned int shift = __builtin_ctzll( page_size );
+
+	pthread_mutex_lock( &dom->tlb_lock );
+
+	if ( dom->tlb ) {
+		struct kvmi_tlb_entry *e = kvmi_tlb_slot( dom, cr3, gva >> shift, shift );
+
+		e->cr3   = cr3;
+		e->page  = gva >> shift;
+		e->gpa   = gpa & ~( page_size - 1 );
+		e->shift = shift;
+		e->flags = flags;
+	}
+
+	pthread_mutex_unlock( &dom->tlb_lock );
+}
+
+/* must be called with tlb_lock held */
+static void __kvmi_tlb_flush_cr3( struct kvmi_dom *dom, __u64 cr3, bool all )
+{
+	size_t k;
+
+	for ( k = 0; k < dom->tlb_size; k++ )
+		if ( all || dom->tlb[k].cr3 == cr3 )
+			dom->tlb[k].shift = 0;
+}
+
+static void kvmi_tlb_set_vcpu_cr3( struct kvmi_dom *dom, unsigned int vcpu, __u64 cr3 )
+{
+	if ( vcpu >= dom->vcpu_cr3_count ) {
+		unsigned int count = vcpu + 1;
+		__u64 *      p;
+
+		p = realloc( dom->vcpu_cr3, count * sizeof( *p ) );
+		if ( !p )
+			return;
+
+		memset( p + dom->vcpu_cr3_count, 0, ( count - dom->vcpu_cr3_count ) * sizeof( *p ) );
+		dom->vcpu_cr3       = p;
+		dom->vcpu_cr3_count = count;
+	}
+
+	dom->vcpu_cr3[vcpu] = cr3;
+}
+
+/*
+ * Every event carries the vCPU's CR3, used to tag the translations requested
+ * with kvmi_translate_gva(). A CR3 write flushes the entries of the new
+ * address space and a CR4 write (paging mode changes) flushes everything.
+ */
+static void kvmi_tlb_observe_event( struct kvmi_dom *dom, const struct kvmi_dom_event *ev )
+{
+	const struct kvmi_event *common = &ev->event.common;
+
+	pthread_mutex_lock( &dom->tlb_lock );
+
+	if ( !dom->tlb )
+		goto out;
+
+	kvmi_tlb_set_vcpu_cr3( dom, common->vcpu, common->arch.sregs.cr3 );
+
+	if ( common->event == KVMI_EVENT_CR ) {
+		if ( ev->event.cr.cr == 3 ) {
+			__kvmi_tlb_flush_cr3( dom, ev->event.cr.new_value & X86_PTE_ADDR, false );
+			/* unknown until the write is done */
+			kvmi_tlb_set_vcpu_cr3( dom, common->vcpu, 0 );
+		} else if ( ev->event.cr.cr == 4 )
+			__kvmi_tlb_flush_cr3( dom, 0, true );
+	}
+
+out:
+	pthread_mutex_unlock( &dom->tlb_lock );
+}
+
+static __u64 kvmi_tlb_vcpu_cr3( struct kvmi_dom *dom, unsigned short vcpu )
+{
+	__u64 cr3 = 0;
+
+	pthread_mutex_lock( &dom->tlb_lock );
+	if ( vcpu < dom->vcpu_cr3_count )
+		cr3 = dom->vcpu_cr3[vcpu];
+	pthread_mutex_unlock( &dom->tlb_lock );
+
+	return cr3 & X86_PTE_ADDR;
+}
+
+/*
+ * Enables a software TLB with @entries slots (rounded up to a power of two)
+ * for kvmi_translate_gva() and kvmi_walk_gva(). Zero disables it.
+ */
+int kvmi_tlb_enable( void *d, size_t entries )
+{
+	struct kvmi_dom *      dom = d;
+	struct kvmi_tlb_entry *tlb = NULL;
+	size_t                 size;
+
+	for ( size = 1; size < entries; size <<= 1 )
+		;
+
+	if ( entries ) {
+		tlb = calloc( size, sizeof( *tlb ) );
+		if ( !tlb )
+			return -1;
+	}
+
+	pthread_mutex_lock( &dom->tlb_lock );
+
+	free( dom->tlb );
+	dom->tlb        = tlb;
+	dom->tlb_size   = tlb ? size : 0;
+	dom->tlb_hits   = 0;
+	dom->tlb_misses = 0;
+
+	pthread_mutex_unlock( &dom->tlb_lock );
+
+	return 0;
+}
+
+void kvmi_tlb_flush( void *d )
+{
+	struct kvmi_dom *dom = d;
+
+	pthread_mutex_lock( &dom->tlb_lock );
+	__kvmi_tlb_flush_cr3( dom, 0, true );
+	pthread_mutex_unlock( &dom->tlb_lock );
+}
+
+void kvmi_tlb_invalidate( void *d, __u64 cr3, __u64 gva )
+{
+	struct kvmi_dom *dom = d;
+	size_t           k;
+
+	cr3 &= X86_PTE_ADDR;
+
+	pthread_mutex_lock( &dom->tlb_lock );
+
+	for ( k = 0; dom->tlb && k < sizeof( tlb_shifts ) / sizeof( tlb_shifts[0] ); k++ ) {
+		unsigned int           shift = tlb_shifts[k];
+		struct kvmi_tlb_entry *e     = kvmi_tlb_slot( dom, cr3, gva >> shift, shift );
+
+		if ( e->shift == shift && e->cr3 == cr3 && e->page == gva >> shift )
+			e->shift = 0;
+	}
+
+	pthread_mutex_unlock( &dom->tlb_lock );
+}
+
+int kvmi_tlb_stats( void *d, unsigned long long *hits, unsigned long long *misses )
+{
+	struct kvmi_dom *dom = d;
+
+	pthread_mutex_lock( &dom->tlb_lock );
+	*hits   = dom->tlb_hits;
+	*misses = dom->tlb_misses;
+	pthread_mutex_unlock( &dom->tlb_lock );
+
+	return 0;
+}
+
+int kvmi_translate_gva( void *dom, unsigned short vcpu, __u64 gva, __u64 *gpa )
+{
+	struct {
+		struct kvmi_vcpu_hdr           vcpu;
+		struct kvmi_vcpu_translate_gva cmd;
+	} req = { .vcpu = { .vcpu = vcpu }, .cmd = { .gva = gva } };
+	struct kvmi_vcpu_translate_gva_reply rpl;
+	size_t                               received = sizeof( rpl );
+	__u64                                cr3      = kvmi_tlb_vcpu_cr3( dom, vcpu );
+	int                                  err;
+
+	if ( cr3 && kvmi_tlb_lookup( dom, cr3, gva, gpa, NULL, NULL, true ) )
+		return 0;
+
+	err = request( dom, KVMI_VCPU_TRANSLATE_GVA, &req, sizeof( req ), &rpl, &received );
+	if ( !err ) {
+		*gpa = rpl.gpa;
+		/* the host returns ~0 for the addresses it cannot translate */
+		if ( cr3 && rpl.gpa != KVMI_INVALID_GPA )
+			kvmi_tlb_insert( dom, cr3, gva, rpl.gpa, 1ULL << X86_PAGE_SHIFT, TLB_RIGHTS_UNKNOWN );
+	}
+
+	return err;
+}
+
+/*
+ * Copies guest physical memory through the mapped memory when available
+ * (no socket traffic for premapped or cached regions) or with
+ * KVMI_READ_PHYSICAL/KVMI_WRITE_PHYSICAL otherwise, including for the
+ * pages that cannot be mapped. The range must not cross a page boundary.
+ */
+static int kvmi_copy_guest_page( struct kvmi_dom *dom, __u64 gpa, void *buf, size_t size, bool write )
+{
+	char *page = MAP_FAILED;
+
+	if ( dom->mem_fd >= 0 )
+		page = kvmi_map_physical_page( dom, gpa );
+
+	if ( page == MAP_FAILED ) {
+		if ( write )
+			return socket_write_physical( dom, gpa, buf, size );
+		return socket_read_physical( dom, gpa, buf, size );
+	}
+
+	if ( write )
+		memcpy( page, buf, size );
+	else
+		memcpy( buf, page, size );
+
+	return kvmi_unmap_physical_page( dom, page );
+}
+
+static int kvmi_copy_guest_range( struct kvmi_dom *dom, __u64 gpa, void *buf, size_t size, bool write )
+{
+	while ( size ) {
+		size_t chunk = MIN( size, ( size_t )pagesize - ( gpa & ( pagesize - 1 ) ) );
+
+		if ( kvmi_copy_guest_page( dom, gpa, buf, chunk, write ) )
+			return -1;
+
+		gpa += chunk;
+		buf = ( char * )buf + chunk;
+		size -= chunk;
+	}
+
+	return 0;
+}
+
+static int read_pte( struct kvmi_dom *dom, __u64 gpa, size_t size, __u64 *pte )
+{
+	*pte = 0;
+
+	return kvmi_copy_guest_page( dom, gpa, pte, size, false );
+}
+
+/*
+ * Walks the guest page tables described by @sregs (CR0, CR3, CR4 and EFER)
+ * over the guest memory. 32-bit, PAE, 4-level and 5-level paging are
+ * supported. On success, @page_size holds the size of the (possibly large)
+ * page and @flags the access rights accumulated over all levels.
+ */
+int kvmi_walk_gva( void *d, const struct kvm_sregs *sregs, __u64 gva, __u64 *gpa, __u64 *page_size,
+                   unsigned int *flags )
+{
+	struct kvmi_dom *dom     = d;
+	bool             nxe     = sregs->efer & X86_EFER_NXE;
+	unsigned int     rights  = KVMI_GVA_WRITABLE | KVMI_GVA_USER;
+	size_t           pte_len = sizeof( __u64 );
+	__u64            table, pte = 0, size;
+	int              level, bits;
+
+	if ( !( sregs->cr0 & X86_CR0_PG ) ) {
+		*gpa = gva;
+		size = 1ULL << X86_PAGE_SHIFT;
+		goto out;
+	}
+
+	if ( dom->tlb && kvmi_tlb_lookup( dom, sregs->cr3 & X86_PTE_ADDR, gva, gpa, page_size, flags, false ) )
+		return 0;
+
+	if ( sregs->efer & X86_EFER_LMA ) {
+		level = ( sregs->cr4 & X86_CR4_LA57 ) ? 5 : 4;
+		bits  = 9;
+		table = sregs->cr3 & X86_PTE_ADDR;
+	} else if ( sregs->cr4 & X86_CR4_PAE ) {
+		/* the PDPTE has no access rights */
+		__u64 pdpte = ( sregs->cr3 & 0xffffffe0ULL ) + ( ( gva >> 30 ) & 3 ) * pte_len;
+
+		if ( read_pte( dom, pdpte, pte_len, &pte ) )
+			return -1;
+		if ( !( pte & X86_PTE_P ) )
+			goto out_fault;
+
+		level = 2;
+		bits  = 9;
+		table = pte & X86_PTE_ADDR;
+	} else {
+		level   = 2;
+		bits    = 10;
+		pte_len = sizeof( __u32 );
+		table   = sregs->cr3 & 0xfffff000ULL;
+
+		gva &= 0xffffffffULL;
+	}
+
+	for ( ; level; level-- ) {
+		unsigned int shift = X86_PAGE_SHIFT + bits * ( level - 1 );
+		__u64        index = ( gva >> shift ) & ( ( 1ULL << bits ) - 1 );
+
+		if ( read_pte( dom, table + index * pte_len, pte_len, &pte ) )
+			return -1;
+
+		if ( !( pte & X86_PTE_P ) )
+			goto out_fault;
+
+		if ( !( pte & X86_PTE_RW ) )
+			rights &= ~KVMI_GVA_WRITABLE;
+		if ( !( pte & X86_PTE_US ) )
+			rights &= ~KVMI_GVA_USER;
+		if ( nxe && ( pte & X86_PTE_NX ) )
+			rights |= KVMI_GVA_NX;
+
+		if ( level == 1 )
+			break;
+
+		if ( ( pte & X86_PTE_PS ) && ( level < 4 ) && ( pte_len == sizeof( __u64 ) || sregs->cr4 & X86_CR4_PSE ) ) {
+			size = 1ULL << shift;
+
+			if ( pte_len == sizeof( __u64 ) )
+				*gpa = ( pte & X86_PTE_ADDR & ~( size - 1 ) ) | ( gva & ( size - 1 ) );
+			else /* PSE-36 */
+				*gpa = ( pte & 0xffc00000ULL ) | ( ( ( pte >> 13 ) & 0xff ) << 32 ) |
+				       ( gva & ( size - 1 ) );
+			goto out;
+		}
+
+		table = pte & ( pte_len == sizeof( __u64 ) ? X86_PTE_ADDR : 0xfffff000ULL );
+	}
+
+	size = 1ULL << X86_PAGE_SHIFT;
+	*gpa = ( pte & ( pte_len == sizeof( __u64 ) ? X86_PTE_ADDR : 0xfffff000ULL ) ) | ( gva & ( size - 1 ) );
+
+out:
+	if ( dom->tlb && ( sregs->cr0 & X86_CR0_PG ) )
+		kvmi_tlb_insert( dom, sregs->cr3 & X86_PTE_ADDR, gva, *gpa, size, rights );
+	if ( page_size )
+		*page_size = size;
+	if ( flags )
+		*flags = rights;
+	return 0;
+
+out_fault:
+	errno = EFAULT;
+	return -1;
+}
+
+static int kvmi_access_virtual( struct kvmi_dom *dom, const struct kvm_sregs *sregs, __u64 gva, void *buffer,
+                                size_t size, bool write )
+{
+	char *buf = buffer;
+
+	while ( size ) {
+		size_t chunk = MIN( size, ( size_t )pagesize - ( gva & ( pagesize - 1 ) ) );
+		__u64  gpa;
+
+		if ( kvmi_walk_gva( dom, sregs, gva, &gpa, NULL, NULL ) )
+			return -1;
+
+		if ( kvmi_copy_guest_page( dom, gpa, buf, chunk, write ) )
+			return -1;
+
+		gva += chunk;
+		buf += chunk;
+		size -= chunk;
+	}
+
+	return 0;
+}
+
+int kvmi_read_virtual( void *dom, const struct kvm_sregs *sregs, __u64 gva, void *buffer, size_t size )
+{
+	return kvmi_access_virtual( dom, sregs, gva, buffer, size, false );
+}
+
+int kvmi_write_virtual( void *dom, const struct kvm_sregs *sregs, __u64 gva, const void *buffer, size_t size )
+{
+	return kvmi_access_virtual( dom, sregs, gva, ( void * )buffer, size, true );
+}
+
+struct kvmi_translate_gva_msg {
+	struct kvmi_msg_hdr            hdr;
+	struct kvmi_vcpu_hdr           vcpu;
+	struct kvmi_vcpu_translate_gva cmd;
+};
+
+static int kvmi_translate_gva_pipeline( struct kvmi_dom *dom, struct kvmi_translate_gva_msg *msgs, size_t n,
+                                        __u64 *gpas, const size_t *idx, size_t *failed )
+{
+	struct iovec iov = { .iov_base = msgs, .iov_len = n * sizeof( *msgs ) };
+	size_t       k;
+	int          err = 0;
+
+	pthread_mutex_lock( &dom->lock );
+
+	if ( do_write( dom, &iov, 1, iov.iov_len ) ) {
+		pthread_mutex_unlock( &dom->lock );
+		return -1;
+	}
+
+	for ( k = 0; k < n; k++ ) {
+		struct kvmi_vcpu_translate_gva_reply rpl;
+		size_t                               received = sizeof( rpl );
+		int                                  ret;
+
+		ret = recv_pipelined_reply( dom, &msgs[k].hdr, &rpl, &received );
+		if ( ret < 0 ) {
+			err = -1;
+			break;
+		}
+
+		/* the host returns ~0 for the addresses it cannot translate */
+		if ( ret || rpl.gpa == KVMI_INVALID_GPA ) {
+			gpas[idx[k]] = KVMI_INVALID_GPA;
+			( *failed )++;
+		} else
+			gpas[idx[k]] = rpl.gpa;
+	}
+
+	pthread_mutex_unlock( &dom->lock );
+
+	return err;
+}
+
+/* caches the translations just received, the TLB hits are left alone */
+static void kvmi_translate_gva_cache( struct kvmi_dom *dom, __u64 cr3, const __u64 *gvas, const __u64 *gpas,
+                                      const size_t *idx, size_t n )
+{
+	size_t k;
+
+	if ( !cr3 )
+		return;
+
+	for ( k = 0; k < n; k++ ) {
+		size_t i = idx[k];
+
+		if ( gpas[i] != KVMI_INVALID_GPA )
+			kvmi_tlb_insert( dom, cr3, gvas[i], gpas[i], 1ULL << X86_PAGE_SHIFT, TLB_RIGHTS_UNKNOWN );
+	}
+}
+
+/*
+ * Translates @count addresses with all the KVMI_VCPU_TRANSLATE_GVA requests
+ * sent in one write and the replies collected in order. Addresses that
+ * cannot be translated get KVMI_INVALID_GPA. Returns the number of such
+ * addresses or -1 if the requests could not be sent/received.
+ */
+ssize_t kvmi_translate_gva_vec( void *d, unsigned short vcpu, const __u64 *gvas, __u64 *gpas, size_t count )
+{
+	struct kvmi_dom *              dom = d;
+	struct kvmi_translate_gva_msg *msgs;
+	size_t *                       idx;
+	size_t                         k, n = 0, failed = 0;
+	__u64                          cr3 = kvmi_tlb_vcpu_cr3( dom, vcpu );
+	int                            err = 0;
+
+	if ( !count )
+		return 0;
+
+	msgs = calloc( MIN( count, MAX_PIPELINED_MSGS ), sizeof( *msgs ) );
+	idx  = calloc( MIN( count, MAX_PIPELINED_MSGS ), sizeof( *idx ) );
+	if ( !msgs || !idx ) {
+		err = -1;
+		goto out;
+	}
+
+	for ( k = 0; k < count; k++ ) {
+		struct kvmi_translate_gva_msg *msg = &msgs[n];
+
+		if ( cr3 && kvmi_tlb_lookup( dom, cr3, gvas[k], &gpas[k], NULL, NULL, true ) )
+			continue;
+
+		msg->hdr.id    = KVMI_VCPU_TRANSLATE_GVA;
+		msg->hdr.seq   = new_seq();
+		msg->hdr.size  = sizeof( *msg ) - sizeof( msg->hdr );
+		msg->vcpu.vcpu = vcpu;
+		msg->cmd.gva   = gvas[k];
+		idx[n++]       = k;
+
+		if ( n == MAX_PIPELINED_MSGS ) {
+			err = kvmi_translate_gva_pipeline( dom, msgs, n, gpas, idx, &failed );
+			if ( err )
+				goto out;
+			kvmi_translate_gva_cache( dom, cr3, gvas, gpas, idx, n );
+			n = 0;
+		}
+	}
+
+	if ( n ) {
+		err = kvmi_translate_gva_pipeline( dom, msgs, n, gpas, idx, &failed );
+		if ( !err )
+			kvmi_translate_gva_cache( dom, cr3, gvas, gpas, idx, n );
+	}
+
+out:
+	free( msgs );
+	free( idx );
+
+	return err ? err : ( ssize_t )failed;
+}
+
+int kvmi_change_gfn( void *dom, unsigned short vcpu, unsigned short view, __u64 old_gfn, __u64 new_gfn )
+{
+	struct {
+		struct kvmi_vcpu_hdr        vcpu;
+		struct kvmi_vcpu_change_gfn cmd;
+	} req = { .vcpu = { .vcpu = vcpu }, .cmd = { .view = view, .old_gfn = old_gfn, .new_gfn = new_gfn } };
+
+	return request( dom, KVMI_VCPU_CHANGE_GFN, &req, sizeof( req ), NULL, NULL );
+}
+
+int kvmi_alloc_gfn( void *dom, __u64 gfn )
+{
+	struct {
+		struct kvmi_vcpu_hdr        vcpu;
+		struct kvmi_vcpu_alloc_gfn  cmd;
+	} req = { .vcpu = { .vcpu = 0 }, .cmd = { .gfn = gfn } };
+
+	return request( dom, KVMI_VCPU_ALLOC_GFN, &req, sizeof( req ), NULL, NULL );
+}
+
+int kvmi_free_gfn( void *dom, __u64 gfn )
+{
+	struct {
+		struct kvmi_vcpu_hdr        vcpu;
+		struct kvmi_vcpu_free_gfn   cmd;
+	} req = { .vcpu = { .vcpu = 0 }, .cmd = { .gfn = gfn } };
+
+	return request( dom, KVMI_VCPU_FREE_GFN, &req, sizeof( req ), NULL, NULL );
+}
+
+int kvmi_create_ept_view( void *dom, unsigned short *view )
+{
+	struct kvmi_create_ept_view_reply rpl;
+	int                               err;
+	size_t                            received = sizeof( rpl );
+
+	err = request( dom, KVMI_CREATE_EPT_VIEW, NULL, 0, &rpl, &received );
+	if ( !err ) {
+		kvmi_views_set_created( dom, rpl.view, true );
+		if ( view )
+			*view = rpl.view;
+	}
+
+	return err;
+}
+
+int kvmi_destroy_ept_view( void *dom, unsigned short view )
+{
+	struct kvmi_destroy_ept_view req = { .view = view };
+	int                          err;
+
+	err = request( dom, KVMI_DESTROY_EPT_VIEW, &req, sizeof( req ), NULL, 0 );
+	if ( !err )
+		kvmi_views_set_created( dom, view, false );
+
+	return err;
+}
+
+struct kvmi_scan_pattern {
+	unsigned char *bytes; /* already masked */
+	unsigned char *mask;
+	size_t         length;
+	size_t         anchor; /* offset of the anchor */
+	unsigned int   anchor_len; /* 2, or 1 if there are no two adjacent non-wildcard bytes */
+	unsigned int   id;
+};
+
+struct kvmi_pattern_set {
+	struct kvmi_scan_pattern *patterns; /* grouped by anchor value */
+	unsigned int              count;
+	unsigned int              pairs; /* [0, pairs) have two byte anchors, the rest one byte */
+	unsigned int *            bucket; /* [anchor, anchor + 1) -> patterns */
+	__u64                     anchors[65536 / 64];
+	__u64                     single_anchors[256 / 64];
+	size_t                    max_length;
+	size_t                    max_anchor;
+	size_t                    max_single_anchor;
+	unsigned char             lo[2][16]; /* nibble tables for the anchor bytes */
+	unsigned char             hi[2][16];
+	bool                      avx2;
+};
+
+struct kvmi_scan_job {
+	struct kvmi_dom *              dom;
+	const struct kvmi_pattern_set *set;
+	unsigned long long             start_gfn;
+	unsigned long long             end_gfn;
+	unsigned long long             next_chunk;
+	size_t                         overlap_pages;
+	kvmi_scan_cb                   cb;
+	void *                         ctx;
+	bool                           stop;
+	bool                           failed;
+};
+
+static unsigned int byte_weight( unsigned char b )
+{
+	/* padding and filler bytes make poor anchors */
+	return ( b == 0x00 || b == 0xff || b == 0xcc || b == 0x90 ) ? 1 : 0;
+}
+
+/*
+ * Picks two adjacent non-wildcard bytes or, if there are none, a single
+ * one. Returns the anchor length (0 if every byte has a wildcard bit).
+ */
+static unsigned int kvmi_pattern_anchor( const unsigned char *mask, size_t length, const unsigned char *bytes,
+                                         size_t *anchor )
+{
+	unsigned int best = ~0U;
+	size_t       k;
+
+	for ( k = 0; k + 1 < length; k++ ) {
+		unsigned int weight;
+
+		if ( mask[k] != 0xff || mask[k + 1] != 0xff )
+			continue;
+
+		weight = byte_weight( bytes[k] ) + byte_weight( bytes[k + 1] );
+		if ( weight < best ) {
+			best    = weight;
+			*anchor = k;
+		}
+	}
+
+	if ( best != ~0U )
+		return 2;
+
+	for ( k = 0; k < length; k++ ) {
+		if ( mask[k] == 0xff && byte_weight( bytes[k] ) < best ) {
+			best    = byte_weight( bytes[k] );
+			*anchor = k;
+		}
+	}
+
+	return best != ~0U ? 1 : 0;
+}
+
+static unsigned int anchor_value( const unsigned char *p )
+{
+	return p[0] | ( p[1] << 8 );
+}
+
+static bool anchor_is_set( const struct kvmi_pattern_set *set, unsigned int v )
+{
+	return set->anchors[v >> 6] & ( 1ULL << ( v & 63 ) );
+}
+
+void kvmi_free_patterns( void *s )
+{
+	struct kvmi_pattern_set *set = s;
+	unsigned int             k;
+
+	if ( !set )
+		return;
+
+	for ( k = 0; k < set->count && set->patterns; k++ )
+		free( set->patterns[k].bytes );
+
+	free( set->patterns );
+	free( set->bucket );
+	free( set );
+}
+
+/*
+ * Every pattern is indexed by two adjacent non-wildcard bytes (the least
+ * common looking pair). The scanner looks for these anchors (with SIMD
+ * when available) and verifies only the patterns sharing the anchor found.
+ * The patterns without such a pair are indexed by a single byte and found
+ * with a slower, byte by byte, pass.
+ */
+void *kvmi_compile_patterns( const struct kvmi_pattern *patterns, unsigned int count )
+{
+	struct kvmi_pattern_set * set;
+	struct kvmi_scan_pattern *sorted = NULL;
+	unsigned int *            cursor = NULL;
+	unsigned int              k, singles;
+	int                       _errno;
+
+	if ( !count ) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	set = calloc( 1, sizeof( *set ) );
+	if ( !set )
+		return NULL;
+
+	set->patterns = calloc( count, sizeof( *set->patterns ) );
+	set->bucket   = calloc( 65536 + 1, sizeof( *set->bucket ) );
+	cursor        = malloc( 65536 * sizeof( *cursor ) );
+	sorted        = malloc( count * sizeof( *sorted ) );
+	if ( !set->patterns || !set->bucket || !cursor || !sorted )
+		goto out_err;
+
+	set->count = count;
+
+	for ( k = 0; k < count; k++ ) {
+		const struct kvmi_pattern *src = &patterns[k];
+		struct kvmi_scan_pattern * p   = &set->patterns[k];
+		size_t                     j;
+
+		p->bytes = malloc( 2 * src->length + 1 );
+		if ( !p->bytes )
+			goto out_err;
+
+		p->mask   = p->bytes + src->length;
+		p->length = src->length;
+		p->id     = k;
+
+		for ( j = 0; j < src->length; j++ ) {
+			p->mask[j]  = src->mask ? src->mask[j] : 0xff;
+			p->bytes[j] = src->bytes[j] & p->mask[j];
+		}
+
+		p->anchor_len = kvmi_pattern_anchor( p->mask, p->length, p->bytes, &p->anchor );
+
+		switch ( p->anchor_len ) {
+			case 2:
+				set->max_anchor = MAX( set->max_anchor, p->anchor );
+				set->bucket[anchor_value( p->bytes + p->anchor ) + 1]++;
+				set->pairs++;
+				break;
+			case 1:
+				set->max_single_anchor = MAX( set->max_single_anchor, p->anchor );
+				set->single_anchors[p->bytes[p->anchor] >> 6] |= 1ULL << ( p->bytes[p->anchor] & 63 );
+				break;
+			default:
+				errno = EINVAL;
+				goto out_err;
+		}
+
+		set->max_length = MAX( set->max_length, p->length );
+	}
+
+	for ( k = 1; k <= 65536; k++ )
+		set->bucket[k] += set->bucket[k - 1];
+
+	memcpy( cursor, set->bucket, 65536 * sizeof( *cursor ) );
+
+	/* group the patterns by their anchor, the single byte ones go last */
+	for ( k = 0, singles = set->pairs; k < count; k++ ) {
+		const struct kvmi_scan_pattern *p = &set->patterns[k];
+		unsigned int                    v;
+		unsigned int                    n;
+
+		if ( p->anchor_len == 1 ) {
+			sorted[singles++] = *p;
+			continue;
+		}
+
+		v                   = anchor_value( p->bytes + p->anchor );
+		sorted[cursor[v]++] = *p;
+
+		set->anchors[v >> 6] |= 1ULL << ( v & 63 );
+
+		for ( n = 0; n < 2; n++ ) {
+			unsigned char b      = p->bytes[p->anchor + n];
+			unsigned char bucket = 1 << ( ( b >> 4 ) & 7 );
+
+			set->lo[n][b & 15] |= bucket;
+			set->hi[n][b >> 4] |= bucket;
+		}
+	}
+
+	free( set->patterns );
+	set->patterns = sorted;
+
+	free( cursor );
+
+	__builtin_cpu_init();
+	set->avx2 = __builtin_cpu_supports( "avx2" );
+
+	return set;
+
+out_err:
+	_errno = errno;
+	free( sorted );
+	free( cursor );
+	kvmi_free_patterns( set );
+	errno = _errno;
+
+	return NULL;
+}
+
+/* checks the pattern anchored at data[pos] and reports it if it starts before limit */
+static bool kvmi_scan_check( struct kvmi_scan_job *job, const struct kvmi_scan_pattern *p, const unsigned char *data,
+                             size_t len, size_t limit, __u64 gpa, size_t pos )
+{
+	size_t start, j;
+
+	if ( pos < p->anchor )
+		return false;
+
+	start = pos - p->anchor;
+	if ( start >= limit || start + p->length > len )
+		return false;
+
+	for ( j = 0; j < p->length; j++ )
+		if ( ( data[start + j] & p->mask[j] ) != p->bytes[j] )
+			return false;
+
+	if ( job->cb( job->dom, gpa + start, p->id, job->ctx ) ) {
+		__atomic_store_n( &job->stop, true, __ATOMIC_RELAXED );
+		return true;
+	}
+
+	return false;
+}
+
+/* checks the patterns with a two byte anchor at data[pos] */
+static bool kvmi_scan_verify( struct kvmi_scan_job *job, const unsigned char *data, size_t len, size_t limit,
+                              __u64 gpa, size_t pos )
+{
+	const struct kvmi_pattern_set *set = job->set;
+	unsigned int                   v   = anchor_value( data + pos );
+	unsigned int                   k;
+
+	for ( k = set->bucket[v]; k < set->bucket[v + 1]; k++ )
+		if ( kvmi_scan_check( job, &set->patterns[k], data, len, limit, gpa, pos ) )
+			return true;
+
+	return false;
+}
+
+/* checks the patterns with a single byte anchor at data[pos] */
+static bool kvmi_scan_verify_single( struct kvmi_scan_job *job, const unsigned char *data, size_t len, size_t limit,
+                                     __u64 gpa, size_t pos )
+{
+	const struct kvmi_pattern_set *set = job->set;
+	unsigned int                   k;
+
+	for ( k = set->pairs; k < set->count; k++ ) {
+		const struct kvmi_scan_pattern *p = &set->patterns[k];
+
+		if ( p->bytes[p->anchor] == data[pos] && kvmi_scan_check( job, p, data, len, limit, gpa, pos ) )
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Marks the positions where the two anchor bytes may start (a superset,
+ * the nibble tables are shared between bytes with the same low nibble and
+ * the same high nibble modulo 8) and confirms them with the anchor bitmap.
+ * Returns the position from where the scalar loop should continue.
+ */
+__attribute__( ( target( "avx2" ) ) ) static size_t kvmi_scan_avx2( struct kvmi_scan_job *job, const unsigned char *data,
+                                                               size_t len, size_t limit, size_t end, __u64 gpa )
+{
+	const struct kvmi_pattern_set *set  = job->set;
+	const __m256i                  nib  = _mm256_set1_epi8( 0x0f );
+	const __m256i                  zero = _mm256_setzero_si256();
+	__m256i                        lo0  = _mm256_broadcastsi128_si256( _mm_loadu_si128( ( const __m128i * )set->lo[0] ) );
+	__m256i                        hi0  = _mm256_broadcastsi128_si256( _mm_loadu_si128( ( const __m128i * )set->hi[0] ) );
+	__m256i                        lo1  = _mm256_broadcastsi128_si256( _mm_loadu_si128( ( const __m128i * )set->lo[1] ) );
+	__m256i                        hi1  = _mm256_broadcastsi128_si256( _mm_loadu_si128( ( const __m128i * )set->hi[1] ) );
+	size_t                         i;
+
+	for ( i = 0; i + 33 <= len && i < end; i += 32 ) {
+		__m256i  v0 = _mm256_loadu_si256( ( const __m256i * )( data + i ) );
+		__m256i  v1 = _mm256_loadu_si256( ( const __m256i * )( data + i + 1 ) );
+		__m256i  t0, t1;
+		uint32_t cand;
+
+		t0 = _mm256_and_si256( _mm256_shuffle_epi8( lo0, _mm256_and_si256( v0, nib ) ),
+		                       _mm256_shuffle_epi8( hi0, _mm256_and_si256( _mm256_srli_epi16( v0, 4 ), nib ) ) );
+		t1 = _mm256_and_si256( _mm256_shuffle_epi8( lo1, _mm256_and_si256( v1, nib ) ),
+		                       _mm256_shuffle_epi8( hi1, _mm256_and_si256( _mm256_srli_epi16( v1, 4 ), nib ) ) );
+
+		cand = ~( ( uint32_t )_mm256_movemask_epi8( _mm256_cmpeq_epi8( t0, zero ) )
+		          | ( uint32_t )_mm256_movemask_epi8( _mm256_cmpeq_epi8( t1, zero ) ) );
+
+		while ( cand ) {
+			size_t pos = i + __builtin_ctz( cand );
+
+			if ( pos >= end )
+				break;
+
+			if ( anchor_is_set( set, anchor_value( data + pos ) )
+			     && kvmi_scan_verify( job, data, len, limit, gpa, pos ) )
+				return end;
+
+			cand &= cand - 1;
+		}
+
+		if ( __atomic_load_n( &job->stop, __ATOMIC_RELAXED ) )
+			return end;
+	}
+
+	return i;
+}
+
+/* scans data[0, len) for matches starting in [0, limit) */
+static void kvmi_scan_run( struct kvmi_scan_job *job, const unsigned char *data, size_t len, size_t limit,
+                           __u64 gpa )
+{
+	const struct kvmi_pattern_set *set = job->set;
+	size_t                         end, i = 0;
+
+	if ( set->pairs && len >= 2 ) {
+		end = MIN( len - 1, limit + set->max_anchor );
+
+		if ( set->avx2 )
+			i = kvmi_scan_avx2( job, data, len, limit, end, gpa );
+
+		for ( ; i < end; i++ )
+			if ( anchor_is_set( set, anchor_value( data + i ) )
+			     && kvmi_scan_verify( job, data, len, limit, gpa, i ) )
+				return;
+	}
+
+	if ( set->pairs == set->count || __atomic_load_n( &job->stop, __ATOMIC_RELAXED ) )
+		return;
+
+	end = MIN( len, limit + set->max_single_anchor );
+
+	for ( i = 0; i < end; i++ )
+		if ( ( set->single_anchors[data[i] >> 6] & ( 1ULL << ( data[i] & 63 ) ) )
+		     && kvmi_scan_verify_single( job, data, len, limit, gpa, i ) )
+			return;
+}
+
+typedef bool ( *kvmi_run_fn )( void *arg, const unsigned char *data, size_t off, size_t len );
+
+/*
+ * Gets [gpa, gpa + pages) through a mapped window or, if it cannot be
+ * mapped (eg. because of a hole), into buf with kvmi_read_physical(), and
+ * calls fn() for every run of readable pages (with its offset in the
+ * range) until it returns false. The pages that cannot be read are
+ * skipped, and so is the rest of a hole (see skip_memory_hole()).
+ */
+static void kvmi_guest_runs( struct kvmi_dom *dom, __u64 gpa, size_t pages, unsigned char *buf, kvmi_run_fn fn,
+                             void *arg )
+{
+	size_t         len  = pages << pageshift;
+	unsigned char *data = MAP_FAILED;
+	size_t         k, run;
+	bool           ok;
+
+	if ( dom->mem_fd >= 0 )
+		data = kvmi_map_physical_range( dom, gpa, len );
+
+	if ( data != MAP_FAILED ) {
+		fn( arg, data, 0, len );
+		kvmi_unmap_physical_range( dom, data );
+		return;
+	}
+
+	/* the first page alone, so that a hole does not cost a failed read of the whole range */
+	ok = !kvmi_read_physical( dom, gpa, buf, pagesize );
+	if ( ok && ( pages == 1 || !kvmi_read_physical( dom, gpa + pagesize, buf + pagesize, len - pagesize ) ) ) {
+		fn( arg, buf, 0, len );
+		return;
+	}
+
+	for ( k = 0, run = 0; k <= pages; k++ ) {
+		size_t off = k << pageshift;
+		bool   hole;
+
+		if ( k && k < pages )
+			ok = !kvmi_read_physical( dom, gpa + off, buf + off, pagesize );
+
+		if ( k < pages && ok )
+			continue;
+
+		hole = k < pages && memory_hole( errno );
+
+		if ( k > run && !fn( arg, buf + ( run << pageshift ), run << pageshift, off - ( run << pageshift ) ) )
+			return;
+
+		if ( dom->disconnected )
+			return;
+
+		if ( hole )
+			k = MIN( pages, skip_memory_hole( ( gpa >> pageshift ) + k ) - ( gpa >> pageshift ) ) - 1;
+
+		run = k + 1;
+	}
+}
+
+struct kvmi_scan_chunk {
+	struct kvmi_scan_job *job;
+	__u64                 gpa;
+	size_t                limit;
+};
+
+static bool kvmi_scan_chunk_run( void *arg, const unsigned char *data, size_t off, size_t len )
+{
+	struct kvmi_scan_chunk *chunk = arg;
+
+	/* only the matches starting in the chunk, not in the overlap pages */
+	if ( off < chunk->limit )
+		kvmi_scan_run( chunk->job, data, len, chunk->limit - off, chunk->gpa + off );
+
+	return !__atomic_load_n( &chunk->job->stop, __ATOMIC_RELAXED );
+}
+
+static void *kvmi_scan_worker( void *arg )
+{
+	struct kvmi_scan_job *job = arg;
+	unsigned char *       buf = NULL;
+
+	buf = malloc( ( SCAN_CHUNK_PAGES + job->overlap_pages ) << pageshift );
+	if ( !buf ) {
+		__atomic_store_n( &job->failed, true, __ATOMIC_RELAXED );
+		return NULL;
+	}
+
+	while ( !__atomic_load_n( &job->stop, __ATOMIC_RELAXED ) && !job->dom->disconnected ) {
+		unsigned long long     idx = __atomic_fetch_add( &job->next_chunk, 1, __ATOMIC_RELAXED );
+		unsigned long long     gfn = job->start_gfn + idx * SCAN_CHUNK_PAGES;
+		struct kvmi_scan_chunk chunk;
+		size_t                 pages, extra;
+
+		if ( gfn >= job->end_gfn )
+			break;
+
+		/* the chunk is followed by enough pages for the patterns starting in its last bytes */
+		pages = MIN( SCAN_CHUNK_PAGES, job->end_gfn - gfn );
+		extra = MIN( job->overlap_pages, job->end_gfn - gfn - pages );
+
+		chunk.job   = job;
+		chunk.gpa   = gfn << pageshift;
+		chunk.limit = pages << pageshift;
+
+		kvmi_guest_runs( job->dom, chunk.gpa, pages + extra, buf, kvmi_scan_chunk_run, &chunk );
+	}
+
+	free( buf );
+
+	return NULL;
+}
+
+/*
+ * Scans the guest physical memory [start_gfn, end_gfn) for the compiled
+ * patterns, splitting it in chunks between the given number of threads.
+ * A zero end_gfn means the end of the guest memory. The callback is called
+ * (concurrently) for every match, with the guest physical address of its
+ * first byte, and it can stop the scan by returning non-zero. Matches
+ * crossing chunks, memory regions or mapped windows are found too.
+ */
+int kvmi_scan_memory( void *d, const void *patterns, unsigned long long start_gfn, unsigned long long end_gfn,
+                      unsigned int threads, kvmi_scan_cb cb, void *ctx )
+{
+	struct kvmi_dom *              dom = d;
+	const struct kvmi_pattern_set *set = patterns;
+	struct kvmi_scan_job           job = {};
+	pthread_t                      th[MAX_WORKER_THREADS];
+	unsigned int                   k, started;
+
+	if ( !set || !cb ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ( !end_gfn ) {
+		if ( kvmi_get_maximum_gfn( dom, &end_gfn ) )
+			return -1;
+		end_gfn++;
+	}
+
+	if ( start_gfn >= end_gfn )
+		return 0;
+
+	job.dom           = dom;
+	job.set           = set;
+	job.start_gfn     = start_gfn;
+	job.end_gfn       = end_gfn;
+	job.overlap_pages = ( set->max_length - 1 + pagesize - 1 ) >> pageshift;
+	job.cb            = cb;
+	job.ctx           = ctx;
+
+	threads = MAX( 1U, MIN( threads, MAX_WORKER_THREADS ) );
+
+	for ( started = 0; started < threads - 1; started++ )
+		if ( pthread_create( &th[started], NULL, kvmi_scan_worker, &job ) )
+			break;
+
+	kvmi_scan_worker( &job );
+
+	for ( k = 0; k < started; k++ )
+		pthread_join( th[k], NULL );
+
+	if ( dom->disconnected ) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if ( job.failed ) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+struct kvmi_parallel_job {
+	void ( *fn )( void *arg, size_t k, void *scratch );
+	void * arg;
+	size_t count;
+	size_t next;
+	size_t scratch_size;
+};
+
+static void *kvmi_parallel_worker( void *arg )
+{
+	struct kvmi_parallel_job *job     = arg;
+	void *                    scratch = NULL;
+	size_t                    k;
+
+	if ( job->scratch_size ) {
+		scratch = malloc( job->scratch_size );
+		if ( !scratch )
+			return NULL;
+	}
+
+	while ( ( k = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) ) < job->count )
+		job->fn( job->arg, k, scratch );
+
+	free( scratch );
+
+	return NULL;
+}
+
+/*
+ * Calls fn() for every index in [0, count) from up to 'threads' threads
+ * (the caller included), each with its own scratch buffer.
+ */
+static int kvmi_parallel_run( unsigned int threads, size_t count, void ( *fn )( void *, size_t, void * ), void *arg,
+                              size_t scratch_size )
+{
+	struct kvmi_parallel_job job = { .fn = fn, .arg = arg, .count = count, .scratch_size = scratch_size };
+	pthread_t                th[MAX_WORKER_THREADS];
+	unsigned int             k, started;
+
+	threads = MAX( 1U, MIN( threads, MAX_WORKER_THREADS ) );
+	if ( count < threads )
+		threads = MAX( count, 1 );
+
+	for ( started = 0; started < threads - 1; started++ )
+		if ( pthread_create( &th[started], NULL, kvmi_parallel_worker, &job ) )
+			break;
+
+	kvmi_parallel_worker( &job );
+
+	for ( k = 0; k < started; k++ )
+		pthread_join( th[k], NULL );
+
+	/* the caller's worker could not get its scratch buffer */
+	if ( job.next < count ) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+#define HASH_DIRTY   ( 1 << 0 )
+#define HASH_VALID   ( 1 << 1 )
+#define HASH_CHANGED ( 1 << 2 )
+
+struct kvmi_page_hashes {
+	struct kvmi_dom *   dom;
+	unsigned long long *gfns; /* sorted */
+	__u64 *             hashes;
+	unsigned char *     state;
+	size_t              count;
+	__u64 ( *hash )( const unsigned char *p, size_t size );
+	pthread_mutex_t     lock;
+};
+
+static __u32         crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table( void )
+{
+	unsigned int k, j;
+
+	for ( k = 0; k < 256; k++ ) {
+		__u32 crc = k;
+
+		for ( j = 0; j < 8; j++ )
+			crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? 0x82f63b78 : 0 );
+
+		crc32c_table[k] = crc;
+	}
+}
+
+/*
+ * The page hash is made of the CRC32C of its two halves, computed as two
+ * independent chains (which the CPU can overlap). It detects changes, it
+ * is not meant to resist collisions crafted by the guest.
+ */
+static __u64 page_hash_table( const unsigned char *p, size_t size )
+{
+	const unsigned char *q  = p + size / 2;
+	__u32                c0 = ~0U, c1 = ~0U;
+	size_t               k;
+
+	for ( k = 0; k < size / 2; k++ ) {
+		c0 = ( c0 >> 8 ) ^ crc32c_table[( c0 ^ p[k] ) & 0xff];
+		c1 = ( c1 >> 8 ) ^ crc32c_table[( c1 ^ q[k] ) & 0xff];
+	}
+
+	return ( ( __u64 )~c0 << 32 ) | ( __u32 )~c1;
+}
+
+__attribute__( ( target( "sse4.2" ) ) ) static __u64 page_hash_sse42( const unsigned char *p, size_t size )
+{
+	const __u64 *a  = ( const __u64 * )p;
+	const __u64 *b  = ( const __u64 * )( p + size / 2 );
+	__u64        c0 = ~0U, c1 = ~0U;
+	size_t       k;
+
+	for ( k = 0; k < size / 16; k++ ) {
+		c0 = _mm_crc32_u64( c0, a[k] );
+		c1 = _mm_crc32_u64( c1, b[k] );
+	}
+
+	return ( ( __u64 )( __u32 )~c0 << 32 ) | ( __u32 )~c1;
+}
+
+static void kvmi_page_hashes_worker( void *arg, size_t k, void *scratch )
+{
+	struct kvmi_page_hashes *h     = arg;
+	struct kvmi_dom *        dom   = h->dom;
+	__u64                    gpa   = h->gfns[k] << pageshift;
+	unsigned char            state = h->state[k];
+	const unsigned char *    page  = MAP_FAILED;
+	bool                     valid = false;
+	__u64                    hash  = 0;
+
+	if ( dom->mem_fd >= 0 )
+		page = kvmi_map_physical_page( dom, gpa );
+
+	if ( page != MAP_FAILED ) {
+		hash  = h->hash( page, pagesize );
+		valid = true;
+		kvmi_unmap_physical_page( dom, ( void * )page );
+	} else if ( !kvmi_read_physical( dom, gpa, scratch, pagesize ) ) {
+		hash  = h->hash( scratch, pagesize );
+		valid = true;
+	}
+
+	if ( valid != !!( state & HASH_VALID ) || hash != h->hashes[k] ) {
+		h->hashes[k] = hash;
+		__atomic_fetch_and( &h->state[k], ~HASH_VALID, __ATOMIC_RELAXED );
+		__atomic_fetch_or( &h->state[k], ( valid ? HASH_VALID : 0 ) | HASH_CHANGED, __ATOMIC_RELAXED );
+	}
+}
+
+struct kvmi_page_hashes_subset {
+	struct kvmi_page_hashes *h;
+	const size_t *           idx;
+};
+
+static void kvmi_page_hashes_subset_worker( void *arg, size_t k, void *scratch )
+{
+	struct kvmi_page_hashes_subset *sub = arg;
+
+	kvmi_page_hashes_worker( sub->h, sub->idx[k], scratch );
+}
+
+void kvmi_page_hashes_free( void *p )
+{
+	struct kvmi_page_hashes *h = p;
+
+	if ( !h )
+		return;
+
+	pthread_mutex_destroy( &h->lock );
+	free( h->gfns );
+	free( h->hashes );
+	free( h->state );
+	free( h );
+}
+
+static int compare_gfns( const void *a, const void *b )
+{
+	unsigned long long g1 = *( const unsigned long long * )a;
+	unsigned long long g2 = *( const unsigned long long * )b;
+
+	if ( g1 < g2 )
+		return -1;
+	return g1 > g2;
+}
+
+/*
+ * Hashes the given guest pages (with 'threads' threads), so that they can
+ * be checked later with kvmi_page_hashes_update(). The pages are accessed
+ * through the mapped memory when available.
+ */
+void *kvmi_page_hashes_create( void *dom, const unsigned long long *gfns, size_t count, unsigned int threads )
+{
+	struct kvmi_page_hashes *h;
+	size_t                   k, n;
+
+	h = calloc( 1, sizeof( *h ) );
+	if ( !h )
+		return NULL;
+
+	pthread_mutex_init( &h->lock, NULL );
+
+	h->dom    = dom;
+	h->gfns   = malloc( MAX( count, 1 ) * sizeof( *h->gfns ) );
+	h->hashes = calloc( MAX( count, 1 ), sizeof( *h->hashes ) );
+	h->state  = calloc( MAX( count, 1 ), sizeof( *h->state ) );
+	if ( !h->gfns || !h->hashes || !h->state )
+		goto out_err;
+
+	memcpy( h->gfns, gfns, count * sizeof( *h->gfns ) );
+	qsort( h->gfns, count, sizeof( *h->gfns ), compare_gfns );
+
+	for ( k = 0, n = 0; k < count; k++ )
+		if ( !n || h->gfns[n - 1] != h->gfns[k] )
+			h->gfns[n++] = h->gfns[k];
+
+	h->count = n;
+
+	pthread_once( &crc32c_once, crc32c_init_table );
+
+	__builtin_cpu_init();
+	h->hash = __builtin_cpu_supports( "sse4.2" ) ? page_hash_sse42 : page_hash_table;
+
+	if ( kvmi_parallel_run( threads, h->count, kvmi_page_hashes_worker, h, pagesize ) )
+		goto out_err;
+
+	for ( k = 0; k < h->count; k++ )
+		h->state[k] &= ~HASH_CHANGED;
+
+	return h;
+
+out_err:
+	kvmi_page_hashes_free( h );
+	errno = ENOMEM;
+	return NULL;
+}
+
+/* marks the pages that have to be hashed again by kvmi_page_hashes_update() */
+int kvmi_page_hashes_mark_dirty( void *p, const unsigned long long *gfns, size_t count )
+{
+	struct kvmi_page_hashes *h = p;
+	size_t                   k;
+
+	for ( k = 0; k < count; k++ ) {
+		unsigned long long *found = bsearch( &gfns[k], h->gfns, h->count, sizeof( *h->gfns ), compare_gfns );
+
+		if ( found )
+			__atomic_fetch_or( &h->state[found - h->gfns], HASH_DIRTY, __ATOMIC_RELAXED );
+	}
+
+	return 0;
+}
+
+/* marks the page written by the guest, if the event is a write #PF */
+void kvmi_page_hashes_observe( void *p, const struct kvmi_dom_event *ev )
+{
+	unsigned long long gfn;
+
+	if ( ev->event.common.event != KVMI_EVENT_PF || !( ev->event.page_fault.access & KVMI_PAGE_ACCESS_W ) )
+		return;
+
+	gfn = ev->event.page_fault.gpa >> pageshift;
+
+	kvmi_page_hashes_mark_dirty( p, &gfn, 1 );
+}
+
+/*
+ * Hashes again the dirty pages (or all of them) and returns the gfns of
+ * those that have changed (including those that became readable or
+ * unreadable), in ascending order, in a buffer that must be released
+ * with free().
+ */
+int kvmi_page_hashes_update( void *p, unsigned int threads, bool all, unsigned long long **changed,
+                             size_t *changed_count )
+{
+	struct kvmi_page_hashes *h   = p;
+	size_t *                 idx = NULL;
+	size_t                   k, n = 0, c = 0;
+	int                      err = -1;
+
+	*changed       = NULL;
+	*changed_count = 0;
+
+	pthread_mutex_lock( &h->lock );
+
+	idx = malloc( MAX( h->count, 1 ) * sizeof( *idx ) );
+	if ( !idx )
+		goto out;
+
+	/* the pages marked while they are hashed will be checked next time */
+	for ( k = 0; k < h->count; k++ )
+		if ( ( __atomic_fetch_and( &h->state[k], ~HASH_DIRTY, __ATOMIC_RELAXED ) & HASH_DIRTY ) || all )
+			idx[n++] = k;
+
+	if ( n ) {
+		struct kvmi_page_hashes_subset sub = { .h = h, .idx = idx };
+
+		if ( kvmi_parallel_run( threads, n, kvmi_page_hashes_subset_worker, &sub, pagesize ) )
+			goto out_redirty;
+
+		*changed = malloc( n * sizeof( **changed ) );
+		if ( !*changed )
+			goto out_redirty;
+
+		for ( k = 0; k < n; k++ )
+			if ( __atomic_fetch_and( &h->state[idx[k]], ~HASH_CHANGED, __ATOMIC_RELAXED ) & HASH_CHANGED )
+				( *changed )[c++] = h->gfns[idx[k]];
+	}
+
+	*changed_count = c;
+	pthread_mutex_unlock( &h->lock );
+
+	free( idx );
+
+	return 0;
+
+out_redirty:
+	/* the next call must look at these pages again */
+	for ( k = 0; k < n; k++ )
+		__atomic_fetch_or( &h->state[idx[k]], HASH_DIRTY, __ATOMIC_RELAXED );
+out:
+	pthread_mutex_unlock( &h->lock );
+
+	free( idx );
+
+	return err;
+}
+
+struct kvmi_dump_job {
+	struct kvmi_dom *  dom;
+	int                fd;
+	unsigned long long total;
+	unsigned long long done;
+	off_t              pos; /* stream position */
+	bool               sparse;
+	unsigned char *    zero;
+	kvmi_dump_cb       cb;
+	void *             ctx;
+	pthread_mutex_t    lock;
+	int                err;
+};
+
+struct kvmi_dump_chunk {
+	struct kvmi_dump_job *job;
+	__u64                 gpa;
+	__u64                 pos; /* the pages below it are written */
+};
+
+static bool page_is_zero( const unsigned char *p )
+{
+	const __u64 *q = ( const __u64 * )p;
+	size_t       k;
+
+	for ( k = 0; k < ( size_t )pagesize / sizeof( *q ); k++ )
+		if ( q[k] )
+			return false;
+
+	return true;
+}
+
+/* writes at 'off' or, if it is negative, at the current position of the stream */
+static int write_all( int fd, const unsigned char *p, size_t len, off_t off )
+{
+	while ( len ) {
+		ssize_t n = off < 0 ? write( fd, p, len ) : pwrite( fd, p, len, off );
+
+		if ( n < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+		if ( off >= 0 )
+			off += n;
+	}
+
+	return 0;
+}
+
+static bool kvmi_dump_stopped( struct kvmi_dump_job *job )
+{
+	return __atomic_load_n( &job->err, __ATOMIC_RELAXED ) || job->dom->disconnected;
+}
+
+static void kvmi_dump_fail( struct kvmi_dump_job *job, int err )
+{
+	int none = 0;
+
+	__atomic_compare_exchange_n( &job->err, &none, err, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED );
+}
+
+static void kvmi_dump_progress( struct kvmi_dump_job *job, size_t bytes )
+{
+	pthread_mutex_lock( &job->lock );
+
+	job->done += bytes;
+	if ( job->cb && job->cb( job->dom, job->done, job->total, job->ctx ) )
+		kvmi_dump_fail( job, ECANCELED );
+
+	pthread_mutex_unlock( &job->lock );
+}
+
+/* a device keeps its old content where nothing is written, the gaps get zero pages */
+static bool kvmi_dump_zero_range( struct kvmi_dump_job *job, __u64 from, __u64 to )
+{
+	for ( ; from < to; from += pagesize )
+		if ( write_all( job->fd, job->zero, pagesize, from ) ) {
+			kvmi_dump_fail( job, errno );
+			return false;
+		}
+
+	return true;
+}
+
+/*
+ * Every run of non-zero pages is written at its gpa. In a regular file
+ * the zero pages are left as holes, anything else gets them written.
+ */
+static bool kvmi_dump_pwrite_run( void *arg, const unsigned char *data, size_t off, size_t len )
+{
+	struct kvmi_dump_chunk *chunk = arg;
+	size_t                  k, start = len;
+
+	if ( !chunk->job->sparse ) {
+		if ( !kvmi_dump_zero_range( chunk->job, chunk->pos, chunk->gpa + off ) )
+			return false;
+
+		if ( write_all( chunk->job->fd, data, len, chunk->gpa + off ) ) {
+			kvmi_dump_fail( chunk->job, errno );
+			return false;
+		}
+
+		chunk->pos = chunk->gpa + off + len;
+
+		return !kvmi_dump_stopped( chunk->job );
+	}
+
+	for ( k = 0; k <= len; k += pagesize ) {
+		if ( k < len && !page_is_zero( data + k ) ) {
+			if ( start == len )
+				start = k;
+			continue;
+		}
+
+		if ( start < k && write_all( chunk->job->fd, data + start, k - start, chunk->gpa + off + start ) ) {
+			kvmi_dump_fail( chunk->job, errno );
+			return false;
+		}
+
+		start = len;
+	}
+
+	return !kvmi_dump_stopped( chunk->job );
+}
+
+static void kvmi_dump_pwrite_chunk( void *arg, size_t k, void *buf )
+{
+	struct kvmi_dump_job * job   = arg;
+	unsigned long long     gfn   = ( unsigned long long )k * DUMP_CHUNK_PAGES;
+	size_t                 pages = MIN( DUMP_CHUNK_PAGES, ( job->total >> pageshift ) - gfn );
+	struct kvmi_dump_chunk chunk = { .job = job, .gpa = gfn << pageshift, .pos = gfn << pageshift };
+
+	if ( kvmi_dump_stopped( job ) )
+		return;
+
+	kvmi_guest_runs( job->dom, chunk.gpa, pages, buf, kvmi_dump_pwrite_run, &chunk );
+
+	if ( kvmi_dump_stopped( job ) )
+		return;
+
+	if ( job->sparse || kvmi_dump_zero_range( job, chunk.pos, chunk.gpa + ( pages << pageshift ) ) )
+		kvmi_dump_progress( job, pages << pageshift );
+}
+
+static int kvmi_dump_seekable( struct kvmi_dump_job *job, bool regular, unsigned int threads )
+{
+	size_t chunks = ( ( job->total >> pageshift ) + DUMP_CHUNK_PAGES - 1 ) / DUMP_CHUNK_PAGES;
+	int    err;
+
+	if ( regular ) {
+		/* the holes must read as zeroes and nothing may be left past the image */
+		if ( ftruncate( job->fd, 0 ) || ftruncate( job->fd, job->total ) )
+			return -1;
+		job->sparse = true;
+	} else {
+		job->zero = calloc( 1, pagesize );
+		if ( !job->zero )
+			return -1;
+	}
+
+	err = kvmi_parallel_run( threads, chunks, kvmi_dump_pwrite_chunk, job, DUMP_CHUNK_PAGES << pageshift );
+
+	free( job->zero );
+
+	return err;
+}
+
+/* a stream cannot have holes, the unreadable pages are written as zeroes */
+static bool kvmi_dump_stream_zero( struct kvmi_dump_job *job, off_t end )
+{
+	while ( job->pos < end ) {
+		if ( write_all( job->fd, job->zero, pagesize, -1 ) ) {
+			kvmi_dump_fail( job, errno );
+			return false;
+		}
+		job->pos += pagesize;
+	}
+
+	return true;
+}
+
+static bool kvmi_dump_stream_run( void *arg, const unsigned char *data, size_t off, size_t len )
+{
+	struct kvmi_dump_chunk *chunk = arg;
+	struct kvmi_dump_job *  job   = chunk->job;
+
+	if ( !kvmi_dump_stream_zero( job, chunk->gpa + off ) )
+		return false;
+
+	if ( write_all( job->fd, data, len, -1 ) ) {
+		kvmi_dump_fail( job, errno );
+		return false;
+	}
+
+	job->pos += len;
+
+	return !kvmi_dump_stopped( job );
+}
+
+static int kvmi_dump_stream( struct kvmi_dump_job *job )
+{
+	unsigned char *buf;
+	__u64          gpa;
+
+	buf       = malloc( DUMP_CHUNK_PAGES << pageshift );
+	job->zero = calloc( 1, pagesize );
+	if ( !buf || !job->zero ) {
+		kvmi_dump_fail( job, ENOMEM );
+		goto out;
+	}
+
+	for ( gpa = 0; gpa < job->total && !kvmi_dump_stopped( job ); gpa += DUMP_CHUNK_PAGES << pageshift ) {
+		size_t                 pages = MIN( DUMP_CHUNK_PAGES, ( job->total - gpa ) >> pageshift );
+		struct kvmi_dump_chunk chunk = { .job = job, .gpa = gpa };
+
+		kvmi_guest_runs( job->dom, gpa, pages, buf, kvmi_dump_stream_run, &chunk );
+
+		if ( !kvmi_dump_stopped( job ) && kvmi_dump_stream_zero( job, gpa + ( pages << pageshift ) ) )
+			kvmi_dump_progress( job, pages << pageshift );
+	}
+
+out:
+	free( job->zero );
+	free( buf );
+
+	return job->err ? -1 : 0;
+}
+
+/*
+ * Writes the guest physical memory, as a raw image, to fd. If fd is
+ * seekable, every page is written at file offset = gpa, whatever the
+ * current offset of fd is (and it is left unchanged), and the chunks
+ * are read and written in parallel by 'threads' threads. A regular file
+ * is truncated to the memory size and the zero or unreadable pages are
+ * left as holes. Any other seekable fd (e.g. a block device) gets these
+ * pages written as zeroes. A pipe or socket gets a sequential stream,
+ * with zeroes for the unreadable pages. With KVMI_DUMP_PAUSE, all vCPUs are paused first and
+ * the caller has to reply to their pause events once the dump is done.
+ * The progress callback can cancel the dump (ECANCELED) by returning
+ * non-zero.
+ */
+int kvmi_dump_memory( void *d, int fd, unsigned int flags, unsigned int threads, kvmi_dump_cb cb, void *ctx )
+{
+	struct kvmi_dom *    dom = d;
+	struct kvmi_dump_job job = { .dom = dom, .fd = fd, .cb = cb, .ctx = ctx };
+	unsigned long long   max_gfn;
+	struct stat          st;
+	int                  err;
+
+	if ( kvmi_get_maximum_gfn( dom, &max_gfn ) )
+		return -1;
+
+	if ( flags & KVMI_DUMP_PAUSE ) {
+		unsigned int count;
+
+		if ( kvmi_get_vcpu_count( dom, &count ) || kvmi_pause_all_vcpus( dom, count ) )
+			return -1;
+	}
+
+	job.total = ( max_gfn + 1 ) << pageshift;
+	pthread_mutex_init( &job.lock, NULL );
+
+	if ( lseek( fd, 0, SEEK_CUR ) < 0 )
+		err = kvmi_dump_stream( &job );
+	else if ( fstat( fd, &st ) )
+		err = -1;
+	else
+		err = kvmi_dump_seekable( &job, S_ISREG( st.st_mode ), threads );
+
+	pthread_mutex_destroy( &job.lock );
+
+	if ( !err && job.err ) {
+		errno = job.err;
+		err   = -1;
+	}
+
+	if ( !err && dom->disconnected ) {
+		errno = ENOTCONN;
+		err   = -1;
+	}
+
+	return err;
+}
+
+static bool test_gfn( const __u64 *bitmap, unsigned long long gfn )
+{
+	return bitmap[gfn / 64] & ( 1ULL << ( gfn % 64 ) );
+}
+
+static void set_gfn( __u64 *bitmap, unsigned long long gfn )
+{
+	bitmap[gfn / 64] |= 1ULL << ( gfn % 64 );
+}
+
+struct kvmi_pf_reply_msg {
+	struct kvmi_msg_hdr        hdr;
+	struct kvmi_vcpu_hdr       vcpu;
+	struct kvmi_event_reply    common;
+	struct kvmi_event_pf_reply pf;
+};
+
+static void setup_pf_reply( struct kvmi_pf_reply_msg *rpl, const struct kvmi_dom_event *ev, unsigned char action )
+{
+	memset( rpl, 0, sizeof( *rpl ) );
+	setup_reply_header( &rpl->hdr, ev->seq, sizeof( *rpl ) - sizeof( rpl->hdr ) );
+	rpl->vcpu.vcpu     = ev->event.common.vcpu;
+	rpl->common.action = action;
+	rpl->common.event  = ev->event.common.event;
+}
+
+/*
+ * Restores the write access (to 'rights') and, if 'retry', resumes the
+ * vCPU with RETRY. Called while reading messages (with dom->lock held),
+ * maybe while waiting for the reply of another command. So the command
+ * replies are disabled for our KVMI_SET_PAGE_ACCESS and enabled again
+ * without a reply of their own.
+ */
+static int kvmi_dirty_restore( struct kvmi_dom *dom, const struct kvmi_dom_event *ev, unsigned char rights,
+                               bool retry )
+{
+	struct kvmi_control_cmd_response_msg prefix, suffix;
+	struct {
+		struct kvmi_set_page_access_msg msg;
+		struct kvmi_page_access_entry   entry;
+	} access;
+	struct kvmi_pf_reply_msg rpl;
+	struct iovec             iov[] = {
+		{ .iov_base = &prefix, .iov_len = sizeof( prefix ) },
+		{ .iov_base = &access, .iov_len = sizeof( access ) },
+		{ .iov_base = &suffix, .iov_len = sizeof( suffix ) },
+		{ .iov_base = &rpl, .iov_len = sizeof( rpl ) },
+	};
+
+	disable_command_reply( &prefix, new_seq() );
+	enable_command_reply( &suffix, false );
+
+	memset( &access, 0, sizeof( access ) );
+	access.msg.hdr.id    = KVMI_SET_PAGE_ACCESS;
+	access.msg.hdr.seq   = new_seq();
+	access.msg.hdr.size  = sizeof( access ) - sizeof( access.msg.hdr );
+	access.msg.cmd.view  = ev->event.page_fault.view;
+	access.msg.cmd.count = 1;
+	access.entry.gpa     = ev->event.page_fault.gpa;
+	access.entry.access  = rights;
+
+	setup_pf_reply( &rpl, ev, KVMI_EVENT_ACTION_RETRY );
+
+	if ( do_write( dom, iov, retry ? 4 : 3,
+	               sizeof( prefix ) + sizeof( access ) + sizeof( suffix ) + ( retry ? sizeof( rpl ) : 0 ) ) )
+		return -1;
+
+	/* kept known, the SVE bit of the page is read from here */
+	kvmi_shadow_update( dom, access.msg.cmd.view, &access.entry.gpa, &access.entry.access, 1, true );
+
+	return 0;
+}
+
+/*
+ * Write faults on the tracked pages are recorded and handled here. If a
+ * hook has removed some of the rights of the access, the page gets back
+ * only the write access taken by the tracker and the event goes on, to
+ * the application.
+ */
+static bool kvmi_dirty_intercept( struct kvmi_dom *dom, const struct kvmi_dom_event *ev )
+{
+	const struct kvmi_event_pf *pf  = &ev->event.page_fault;
+	unsigned long long          gfn = pf->gpa >> pageshift;
+	bool                        tracked, hooked;
+
+	if ( ev->event.common.event != KVMI_EVENT_PF || !( pf->access & KVMI_PAGE_ACCESS_W ) )
+		return false;
+
+	pthread_mutex_lock( &dom->dirty_lock );
+
+	tracked = dom->dirty_tracked && gfn < dom->dirty_gfns && pf->view == dom->dirty_view
+	          && test_gfn( dom->dirty_tracked, gfn );
+	if ( tracked ) {
+		set_gfn( dom->dirty_bits, gfn );
+		dom->dirty_faults++;
+	}
+
+	pthread_mutex_unlock( &dom->dirty_lock );
+
+	if ( !tracked )
+		return false;
+
+	hooked = pf->access & kvmi_hooks_removed( dom, pf->view, gfn );
+
+	/* if the reply cannot be sent, the event goes to the application */
+	return !kvmi_dirty_restore( dom, ev, kvmi_page_access_wanted( dom, pf->view, gfn, false ), !hooked ) && !hooked;
+}
+
+/* whether the tracker keeps the page write-protected, with dirty_lock held */
+static bool kvmi_dirty_protects( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn )
+{
+	return dom->dirty_tracked && view == dom->dirty_view && gfn < dom->dirty_gfns
+	       && test_gfn( dom->dirty_tracked, gfn ) && !test_gfn( dom->dirty_bits, gfn );
+}
+
+/*
+ * Write-protects the pages or gives them back the write access, keeping
+ * the rights removed by the hooks and the SVE bit. Serialized with the
+ * hook changes by hooks_apply_lock.
+ */
+static int kvmi_dirty_set_access( struct kvmi_dom *dom, unsigned short view, const unsigned long long *gfns,
+                                  size_t count, bool protect )
+{
+	unsigned long long *gpa;
+	unsigned char *     access;
+	void *              grp = NULL;
+	size_t              k;
+	int                 err = -1;
+
+	gpa    = malloc( MAX( count, 1 ) * sizeof( *gpa ) );
+	access = malloc( MAX( count, 1 ) );
+	if ( !gpa || !access )
+		goto out_free;
+
+	pthread_mutex_lock( &dom->hooks_apply_lock );
+
+	for ( k = 0; k < count; k++ ) {
+		gpa[k]    = gfns[k] << pageshift;
+		access[k] = kvmi_page_access_wanted( dom, view, gfns[k], protect );
+	}
+
+	grp = kvmi_batch_alloc( dom );
+	if ( !grp )
+		goto out;
+
+	for ( k = 0; k < count; k += PAGE_ACCESS_MAX_ENTRIES ) {
+		unsigned short n = MIN( count - k, PAGE_ACCESS_MAX_ENTRIES );
+
+		if ( kvmi_queue_page_access( grp, gpa + k, access + k, n, view ) )
+			goto out;
+	}
+
+	err = kvmi_batch_commit( grp );
+	if ( !err )
+		kvmi_shadow_update( dom, view, gpa, access, count, true );
+out:
+	pthread_mutex_unlock( &dom->hooks_apply_lock );
+	kvmi_batch_free( grp );
+out_free:
+	free( access );
+	free( gpa );
+
+	return err;
+}
+
+/* resizes the bitmaps (with dirty_lock held), the new gfns are neither tracked nor dirty */
+static int kvmi_dirty_grow( struct kvmi_dom *dom, unsigned long long gfns )
+{
+	size_t old_words = ( dom->dirty_gfns + 63 ) / 64;
+	size_t words     = ( gfns + 63 ) / 64;
+	__u64 *tracked, *bits;
+
+	tracked = realloc( dom->dirty_tracked, words * sizeof( *tracked ) );
+	if ( tracked )
+		dom->dirty_tracked = tracked;
+
+	bits = tracked ? realloc( dom->dirty_bits, words * sizeof( *bits ) ) : NULL;
+	if ( bits )
+		dom->dirty_bits = bits;
+
+	if ( !tracked || !bits ) {
+		/* nothing is tracked yet, do not look like it */
+		if ( !dom->dirty_gfns ) {
+			free( dom->dirty_tracked );
+			free( dom->dirty_bits );
+			dom->dirty_tracked = NULL;
+			dom->dirty_bits    = NULL;
+		}
+		return -1;
+	}
+
+	memset( tracked + old_words, 0, ( words - old_words ) * sizeof( *tracked ) );
+	memset( bits + old_words, 0, ( words - old_words ) * sizeof( *bits ) );
+
+	dom->dirty_gfns = gfns;
+
+	return 0;
+}
+
+/*
+ * Starts tracking the writes to the given pages (from the given view).
+ * The pages are write-protected and every first write #PF is handled in
+ * the library: the page is marked as dirty, the write access is restored
+ * and the vCPU is resumed (RETRY), without the event being delivered.
+ * The #PF events must be enabled by the application. The rights removed
+ * by the hooks and the SVE bit are kept and the write faults matching a
+ * hook are still delivered, after being recorded.
+ */
+int kvmi_dirty_track( void *d, unsigned short view, const unsigned long long *gfns, size_t count )
+{
+	struct kvmi_dom *  dom = d;
+	unsigned long long max_gfn;
+	size_t             k;
+
+	if ( kvmi_get_maximum_gfn( dom, &max_gfn ) )
+		return -1;
+
+	for ( k = 0; k < count; k++ ) {
+		if ( gfns[k] > max_gfn ) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock( &dom->dirty_lock );
+
+	if ( dom->dirty_tracked && dom->dirty_view != view ) {
+		pthread_mutex_unlock( &dom->dirty_lock );
+		errno = EBUSY;
+		return -1;
+	}
+
+	if ( !dom->dirty_tracked ) {
+		dom->dirty_view   = view;
+		dom->dirty_faults = 0;
+	}
+
+	/* the guest memory may have grown since the first call */
+	if ( max_gfn >= dom->dirty_gfns && kvmi_dirty_grow( dom, max_gfn + 1 ) ) {
+		pthread_mutex_unlock( &dom->dirty_lock );
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for ( k = 0; k < count; k++ )
+		set_gfn( dom->dirty_tracked, gfns[k] );
+
+	pthread_mutex_unlock( &dom->dirty_lock );
+
+	return kvmi_dirty_set_access( dom, view, gfns, count, true );
+}
+
+/* restores the write access for all tracked pages and stops tracking */
+int kvmi_dirty_stop( void *d )
+{
+	struct kvmi_dom *   dom = d;
+	unsigned long long *gfns;
+	unsigned long long  gfn;
+	size_t              n = 0;
+	int                 err;
+
+	pthread_mutex_lock( &dom->dirty_lock );
+
+	if ( !dom->dirty_tracked ) {
+		pthread_mutex_unlock( &dom->dirty_lock );
+		return 0;
+	}
+
+	gfns = malloc( dom->dirty_gfns * sizeof( *gfns ) );
+	if ( gfns )
+		for ( gfn = 0; gfn < dom->dirty_gfns; gfn++ )
+			if ( test_gfn( dom->dirty_tracked, gfn ) )
+				gfns[n++] = gfn;
+
+	pthread_mutex_unlock( &dom->dirty_lock );
+
+	if ( !gfns )
+		return -1;
+
+	/* the faults are still handled while the access is restored */
+	err = kvmi_dirty_set_access( dom, dom->dirty_view, gfns, n, false );
+
+	free( gfns );
+
+	if ( err )
+		return -1;
+
+	pthread_mutex_lock( &dom->dirty_lock );
+	free( dom->dirty_tracked );
+	free( dom->dirty_bits );
+	dom->dirty_tracked = NULL;
+	dom->dirty_bits    = NULL;
+	dom->dirty_gfns    = 0;
+	pthread_mutex_unlock( &dom->dirty_lock );
+
+	return 0;
+}
+
+/*
+ * Returns (in a buffer that must be released with free()) the pages
+ * written since the previous call and write-protects them again. The
+ * dirty set is reset before the pages are protected, so the writes made
+ * after this function returns are reported by the next call, while those
+ * made meanwhile are visible when the returned pages are read.
+ */
+int kvmi_dirty_collect_and_reset( void *d, unsigned long long **gfns, size_t *count )
+{
+	struct kvmi_dom *  dom = d;
+	unsigned long long base;
+	unsigned short     view;
+	size_t             n = 0;
+
+	*gfns  = NULL;
+	*count = 0;
+
+	pthread_mutex_lock( &dom->dirty_lock );
+
+	if ( !dom->dirty_tracked ) {
+		pthread_mutex_unlock( &dom->dirty_lock );
+		errno = EINVAL;
+		return -1;
+	}
+
+	for ( base = 0; base < dom->dirty_gfns; base += 64 )
+		n += __builtin_popcountll( dom->dirty_bits[base / 64] );
+
+	*gfns = malloc( MAX( n, 1 ) * sizeof( **gfns ) );
+	if ( !*gfns ) {
+		pthread_mutex_unlock( &dom->dirty_lock );
+		return -1;
+	}
+
+	n = 0;
+	for ( base = 0; base < dom->dirty_gfns; base += 64 ) {
+		__u64 word = dom->dirty_bits[base / 64];
+
+		dom->dirty_bits[base / 64] = 0;
+
+		for ( ; word; word &= word - 1 )
+			( *gfns )[n++] = base + __builtin_ctzll( word );
+	}
+
+	view = dom->dirty_view;
+
+	pthread_mutex_unlock( &dom->dirty_lock );
+
+	*count = n;
+
+	if ( n && kvmi_dirty_set_access( dom, view, *gfns, n, true ) ) {
+		free( *gfns );
+		*gfns  = NULL;
+		*count = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The access rights set by the library are kept per view, in a three
+ * level radix tree indexed by gfn, with one byte per page (SHADOW_VALID
+ * plus the access bits). Pages with unknown rights have a zero byte.
+ */
+struct kvmi_access_shadow {
+	list_t             link;
+	unsigned short     view;
+	unsigned char ***  dir;
+	unsigned long long dir_len;
+};
+
+static struct kvmi_access_shadow *kvmi_shadow_find( struct kvmi_dom *dom, unsigned short view, bool create )
+{
+	struct kvmi_access_shadow *root;
+	list_t *                   i;
+
+	list_for_each( i, &dom->access_shadows )
+	{
+		root = list_container( i, struct kvmi_access_shadow, link );
+		if ( root->view == view )
+			return root;
+	}
+
+	if ( !create )
+		return NULL;
+
+	root = calloc( 1, sizeof( *root ) );
+	if ( !root )
+		return NULL;
+
+	root->view = view;
+	list_add_tail( &dom->access_shadows, &root->link );
+
+	return root;
+}
+
+static unsigned char *kvmi_shadow_entry( struct kvmi_access_shadow *root, unsigned long long gfn, bool create )
+{
+	unsigned long long top = gfn >> ( SHADOW_LEAF_BITS + SHADOW_MID_BITS );
+	size_t             mid = ( gfn >> SHADOW_LEAF_BITS ) & ( ( 1 << SHADOW_MID_BITS ) - 1 );
+	unsigned char **   leaves;
+
+	if ( top >= root->dir_len ) {
+		unsigned char ***dir;
+
+		if ( !create )
+			return NULL;
+
+		dir = realloc( root->dir, ( top + 1 ) * sizeof( *dir ) );
+		if ( !dir )
+			return NULL;
+
+		memset( dir + root->dir_len, 0, ( top + 1 - root->dir_len ) * sizeof( *dir ) );
+		root->dir     = dir;
+		root->dir_len = top + 1;
+	}
+
+	leaves = root->dir[top];
+	if ( !leaves ) {
+		if ( !create )
+			return NULL;
+
+		leaves = root->dir[top] = calloc( 1 << SHADOW_MID_BITS, sizeof( *leaves ) );
+		if ( !leaves )
+			return NULL;
+	}
+
+	if ( !leaves[mid] ) {
+		if ( !create )
+			return NULL;
+
+		leaves[mid] = calloc( 1, 1 << SHADOW_LEAF_BITS );
+		if ( !leaves[mid] )
+			return NULL;
+	}
+
+	return leaves[mid] + ( gfn & ( ( 1 << SHADOW_LEAF_BITS ) - 1 ) );
+}
+
+static void kvmi_shadow_free( struct kvmi_access_shadow *root )
+{
+	unsigned long long top;
+	size_t             mid;
+
+	for ( top = 0; top < root->dir_len; top++ ) {
+		if ( !root->dir[top] )
+			continue;
+
+		for ( mid = 0; mid < ( 1 << SHADOW_MID_BITS ); mid++ )
+			free( root->dir[top][mid] );
+
+		free( root->dir[top] );
+	}
+
+	free( root->dir );
+	free( root );
+}
+
+/* sets the entries of [gfn, gfn + count), one leaf at a time (the missing leaves are skipped unless 'create') */
+static void kvmi_shadow_fill( struct kvmi_access_shadow *root, unsigned long long gfn, unsigned long long count,
+                              unsigned char value, bool create )
+{
+	while ( count ) {
+		unsigned long long n = ( 1 << SHADOW_LEAF_BITS ) - ( gfn & ( ( 1 << SHADOW_LEAF_BITS ) - 1 ) );
+		unsigned char *    entry;
+
+		n     = MIN( n, count );
+		entry = kvmi_shadow_entry( root, gfn, create );
+		if ( entry )
+			memset( entry, value, n );
+
+		gfn += n;
+		count -= n;
+	}
+}
+
+/* records the rights set for these pages or, if !known, forgets them */
+static void kvmi_shadow_update( struct kvmi_dom *dom, unsigned short view, const unsigned long long *gpa,
+                                const unsigned char *access, size_t count, bool known )
+{
+	struct kvmi_access_shadow *root;
+	size_t                     k;
+
+	pthread_mutex_lock( &dom->shadow_lock );
+
+	root = kvmi_shadow_find( dom, view, known );
+
+	for ( k = 0; root && k < count; k++ )
+		kvmi_shadow_fill( root, gpa[k] >> pageshift, 1, known ? SHADOW_VALID | access[k] : 0, known );
+
+	pthread_mutex_unlock( &dom->shadow_lock );
+}
+
+/* whether all these pages are known to have this access */
+static bool kvmi_shadow_range_matches( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn,
+                                       unsigned long long count, unsigned char access )
+{
+	struct kvmi_access_shadow *root;
+	unsigned long long         k;
+	bool                       matches = true;
+
+	pthread_mutex_lock( &dom->shadow_lock );
+
+	root = kvmi_shadow_find( dom, view, false );
+
+	for ( k = 0; matches && k < count; k++ ) {
+		unsigned char *entry = root ? kvmi_shadow_entry( root, gfn + k, false ) : NULL;
+
+		matches = entry && *entry == ( SHADOW_VALID | access );
+	}
+
+	pthread_mutex_unlock( &dom->shadow_lock );
+
+	return matches;
+}
+
+/* the SVE bit recorded for a page (none if its rights are unknown), with shadow_lock held */
+static unsigned char kvmi_shadow_sve( struct kvmi_access_shadow *root, unsigned long long gfn )
+{
+	unsigned char *entry = root ? kvmi_shadow_entry( root, gfn, false ) : NULL;
+
+	return entry ? *entry & KVMI_PAGE_ACCESS_SVE : 0;
+}
+
+static void kvmi_shadow_update_range( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn,
+                                      unsigned long long count, unsigned char access, bool known )
+{
+	struct kvmi_access_shadow *root;
+
+	pthread_mutex_lock( &dom->shadow_lock );
+
+	root = kvmi_shadow_find( dom, view, known );
+	if ( root )
+		kvmi_shadow_fill( root, gfn, count, known ? SHADOW_VALID | access : 0, known );
+
+	pthread_mutex_unlock( &dom->shadow_lock );
+}
+
+/* forgets all the access rights recorded (eg. when they were changed by someone else) */
+void kvmi_reset_page_access_shadow( void *d )
+{
+	struct kvmi_dom *dom = d;
+	list_t *         i;
+	list_t *         j;
+
+	pthread_mutex_lock( &dom->shadow_lock );
+
+	list_for_each_safe( i, j, &dom->access_shadows )
+	{
+		struct kvmi_access_shadow *root = list_container( i, struct kvmi_access_shadow, link );
+
+		list_del( &root->link );
+		kvmi_shadow_free( root );
+	}
+
+	INIT_LIST_HEAD( &dom->access_shadows );
+
+	pthread_mutex_unlock( &dom->shadow_lock );
+}
+
+/*
+ * Brings the pages to the desired access rights, sending (in one batch)
+ * only the changes from the rights previously set by the library. The
+ * number of pages actually changed is returned through 'sent'.
+ */
+int kvmi_set_desired_page_access( void *d, const unsigned long long *gpa, const unsigned char *access, size_t count,
+                                  unsigned short view, size_t *sent )
+{
+	struct kvmi_dom *          dom = d;
+	struct kvmi_access_shadow *root;
+	unsigned long long         batch_gpa[PAGE_ACCESS_MAX_ENTRIES];
+	unsigned char              batch_access[PAGE_ACCESS_MAX_ENTRIES];
+	size_t *                   idx;
+	size_t                     k, n = 0, queued = 0;
+	void *                     grp = NULL;
+	int                        err = -1;
+
+	if ( sent )
+		*sent = 0;
+
+	idx = malloc( MAX( count, 1 ) * sizeof( *idx ) );
+	if ( !idx )
+		return -1;
+
+	pthread_mutex_lock( &dom->shadow_lock );
+
+	root = kvmi_shadow_find( dom, view, false );
+
+	for ( k = 0; k < count; k++ ) {
+		unsigned char *entry = root ? kvmi_shadow_entry( root, gpa[k] >> pageshift, false ) : NULL;
+
+		if ( !entry || *entry != ( SHADOW_VALID | access[k] ) )
+			idx[n++] = k;
+	}
+
+	pthread_mutex_unlock( &dom->shadow_lock );
+
+	if ( !n ) {
+		err = 0;
+		goto out;
+	}
+
+	grp = kvmi_batch_alloc( dom );
+	if ( !grp )
+		goto out;
+
+	for ( k = 0; k < n; k++ ) {
+		batch_gpa[queued]    = gpa[idx[k]];
+		batch_access[queued] = access[idx[k]];
+
+		if ( ++queued == PAGE_ACCESS_MAX_ENTRIES || k == n - 1 ) {
+			if ( kvmi_queue_page_access( grp, batch_gpa, batch_access, queued, view ) )
+				goto out;
+			queued = 0;
+		}
+	}
+
+	err = kvmi_batch_commit( grp );
+	if ( err )
+		goto out;
+
+	for ( k = 0; k < n; k++ )
+		kvmi_shadow_update( dom, view, &gpa[idx[k]], &access[idx[k]], 1, true );
+
+	if ( sent )
+		*sent = n;
+
+out:
+	kvmi_batch_free( grp );
+	free( idx );
+
+	return err;
+}
+
+#define ALL_ACCESS ( KVMI_PAGE_ACCESS_R | KVMI_PAGE_ACCESS_W | KVMI_PAGE_ACCESS_X )
+
+/* the hooks are ordered by (view, gpa) */
+static bool hook_key_less( unsigned short v1, unsigned long long a1, unsigned short v2, unsigned long long a2 )
+{
+	return v1 < v2 || ( v1 == v2 && a1 < a2 );
+}
+
+static bool hook_before( const struct kvmi_hook *hook, unsigned short view, unsigned long long start )
+{
+	return hook_key_less( hook->view, hook->start, view, start );
+}
+
+/* the index of the first hook not before (view, start) */
+static size_t kvmi_hooks_lower_bound( struct kvmi_dom *dom, unsigned short view, unsigned long long start )
+{
+	size_t lo = 0, hi = dom->hook_count;
+
+	while ( lo < hi ) {
+		size_t mid = lo + ( hi - lo ) / 2;
+
+		if ( hook_before( dom->hooks[mid], view, start ) )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void hook_key_raise( unsigned short *view, unsigned long long *end, unsigned short v, unsigned long long e )
+{
+	if ( hook_key_less( *view, *end, v, e ) ) {
+		*view = v;
+		*end  = e;
+	}
+}
+
+/*
+ * The sorted array is also an implicit interval tree: the hook at index i
+ * is a node of level k (the number of trailing 1 bits of i), with its
+ * children at i - 2^(k-1) and i + 2^(k-1), and keeps the largest (view,
+ * end) of its subtree. Rebuilt after every change (O(n), like the
+ * insertion itself), with hooks_lock held.
+ */
+static void kvmi_hooks_index( struct kvmi_dom *dom )
+{
+	struct kvmi_hook **a         = dom->hooks;
+	size_t             n         = dom->hook_count;
+	size_t             i, last_i = 0;
+	unsigned short     last_view = 0;
+	unsigned long long last_end  = 0;
+	int                k;
+
+	dom->hook_levels = -1;
+	if ( !n )
+		return;
+
+	for ( i = 0; i < n; i += 2 ) {
+		a[i]->max_view = a[i]->view;
+		a[i]->max_end  = a[i]->end;
+		last_i         = i;
+		last_view      = a[i]->view;
+		last_end       = a[i]->end;
+	}
+
+	for ( k = 1; ( 1ULL << k ) <= n; k++ ) {
+		size_t x = 1ULL << ( k - 1 );
+
+		for ( i = ( x << 1 ) - 1; i < n; i += x << 2 ) {
+			unsigned short     view = a[i]->view;
+			unsigned long long end  = a[i]->end;
+
+			hook_key_raise( &view, &end, a[i - x]->max_view, a[i - x]->max_end );
+			/* the right subtree may be incomplete, 'last' covers what it has */
+			if ( i + x < n )
+				hook_key_raise( &view, &end, a[i + x]->max_view, a[i + x]->max_end );
+			else
+				hook_key_raise( &view, &end, last_view, last_end );
+
+			a[i]->max_view = view;
+			a[i]->max_end  = end;
+		}
+
+		last_i = ( ( last_i >> k ) & 1 ) ? last_i - x : last_i + x;
+		if ( last_i < n )
+			hook_key_raise( &last_view, &last_end, a[last_i]->max_view, a[last_i]->max_end );
+	}
+
+	dom->hook_levels = k - 1;
+}
+
+typedef bool ( *kvmi_hook_visit )( void *arg, struct kvmi_hook *hook );
+
+/*
+ * Calls visit(), in order, for the hooks of a view overlapping [start,
+ * end) until it returns false. Only the subtrees that may hold such hooks
+ * are walked, so a lookup is O(log n) plus the hooks found, however long
+ * some of them are. Called with hooks_lock held.
+ */
+static void kvmi_hooks_overlap( struct kvmi_dom *dom, unsigned short view, unsigned long long start,
+                                unsigned long long end, kvmi_hook_visit visit, void *arg )
+{
+	struct {
+		int    k;
+		size_t x;
+		bool   left_done;
+	} stack[64];
+	struct kvmi_hook **a = dom->hooks;
+	size_t             n = dom->hook_count;
+	int                t = 0;
+
+	if ( dom->hook_levels < 0 )
+		return;
+
+	stack[t].k         = dom->hook_levels;
+	stack[t].x         = ( 1ULL << dom->hook_levels ) - 1;
+	stack[t].left_done = false;
+	t++;
+
+	while ( t ) {
+		int    k         = stack[--t].k;
+		size_t x         = stack[t].x;
+		bool   left_done = stack[t].left_done;
+
+		if ( k <= 3 ) {
+			/* small subtrees are scanned */
+			size_t i    = x >> k << k;
+			size_t last = MIN( n, i + ( 2ULL << k ) - 1 );
+
+			for ( ; i < last && hook_key_less( a[i]->view, a[i]->start, view, end ); i++ )
+				if ( hook_key_less( view, start, a[i]->view, a[i]->end ) && !visit( arg, a[i] ) )
+					return;
+		} else if ( !left_done ) {
+			size_t y = x - ( 1ULL << ( k - 1 ) );
+
+			/* back for the node itself and its right subtree, after the left one */
+			stack[t].k         = k;
+			stack[t].x         = x;
+			stack[t].left_done = true;
+			t++;
+
+			if ( y >= n || hook_key_less( view, start, a[y]->max_view, a[y]->max_end ) ) {
+				stack[t].k         = k - 1;
+				stack[t].x         = y;
+				stack[t].left_done = false;
+				t++;
+			}
+		} else if ( x < n && hook_key_less( a[x]->view, a[x]->start, view, end ) ) {
+			if ( hook_key_less( view, start, a[x]->view, a[x]->end ) && !visit( arg, a[x] ) )
+				return;
+
+			stack[t].k         = k - 1;
+			stack[t].x         = x + ( 1ULL << ( k - 1 ) );
+			stack[t].left_done = false;
+			t++;
+		}
+	}
+}
+
+/* two 20-bit hashes of the gfn, for the Bloom filter */
+static void hook_filter_hash( unsigned long long gfn, unsigned long long *h1, unsigned long long *h2 )
+{
+	unsigned long long h = gfn * 0x9E3779B97F4A7C15ULL;
+
+	*h1 = ( h >> 44 ) % HOOK_FILTER_BITS;
+	*h2 = ( h >> 24 ) % HOOK_FILTER_BITS;
+}
+
+static void kvmi_hook_filter_add( struct kvmi_dom *dom, const struct kvmi_hook *hook )
+{
+	unsigned long long gfn = hook->start >> pageshift;
+	unsigned long long end = ( ( hook->end - 1 ) >> pageshift ) + 1;
+
+	/* it would be saturated anyway */
+	if ( end - gfn >= HOOK_FILTER_BITS ) {
+		memset( dom->hook_filter, 0xff, HOOK_FILTER_BITS / 8 );
+		return;
+	}
+
+	for ( ; gfn < end; gfn++ ) {
+		unsigned long long h1, h2;
+
+		hook_filter_hash( gfn, &h1, &h2 );
+		set_gfn( dom->hook_filter, h1 );
+		set_gfn( dom->hook_filter, h2 );
+	}
+}
+
+/* false if the gfn is certainly not hooked */
+static bool kvmi_hook_filter_test( struct kvmi_dom *dom, unsigned long long gfn )
+{
+	unsigned long long h1, h2;
+
+	if ( !dom->hook_filter )
+		return false;
+
+	hook_filter_hash( gfn, &h1, &h2 );
+
+	return test_gfn( dom->hook_filter, h1 ) && test_gfn( dom->hook_filter, h2 );
+}
+
+/* Bloom filters cannot forget, so this is rebuilt after removals */
+static void kvmi_hook_filter_rebuild( struct kvmi_dom *dom )
+{
+	size_t k;
+
+	memset( dom->hook_filter, 0, HOOK_FILTER_BITS / 8 );
+
+	for ( k = 0; k < dom->hook_count; k++ )
+		kvmi_hook_filter_add( dom, dom->hooks[k] );
+}
+
+/* takes a hook out of the array, with hooks_lock held */
+static void kvmi_hooks_unlink( struct kvmi_dom *dom, const struct kvmi_hook *hook )
+{
+	size_t k;
+
+	for ( k = kvmi_hooks_lower_bound( dom, hook->view, hook->start ); dom->hooks[k] != hook; k++ )
+		;
+
+	memmove( dom->hooks + k, dom->hooks + k + 1, ( dom->hook_count - k - 1 ) * sizeof( *dom->hooks ) );
+	dom->hook_count--;
+
+	kvmi_hooks_index( dom );
+	kvmi_hook_filter_rebuild( dom );
+}
+
+static void kvmi_hooks_free( struct kvmi_dom *dom )
+{
+	size_t k;
+
+	for ( k = 0; k < dom->hook_count; k++ )
+		free( dom->hooks[k] );
+
+	free( dom->hooks );
+	free( dom->hook_filter );
+	dom->hooks       = NULL;
+	dom->hook_filter = NULL;
+	dom->hook_count  = 0;
+	dom->hook_alloc  = 0;
+	dom->hook_levels = -1;
+}
+
+static int compare_ull( const void *a, const void *b )
+{
+	unsigned long long x = *( const unsigned long long * )a;
+	unsigned long long y = *( const unsigned long long * )b;
+
+	if ( x < y )
+		return -1;
+	return x > y;
+}
+
+struct kvmi_hook_list {
+	struct kvmi_hook **hooks;
+	size_t             count;
+	size_t             alloc;
+	bool               failed;
+};
+
+static bool kvmi_hook_collect( void *arg, struct kvmi_hook *hook )
+{
+	struct kvmi_hook_list *list = arg;
+
+	if ( list->count == list->alloc ) {
+		size_t             alloc = list->alloc ? list->alloc * 2 : 16;
+		struct kvmi_hook **hooks = realloc( list->hooks, alloc * sizeof( *hooks ) );
+
+		if ( !hooks ) {
+			list->failed = true;
+			return false;
+		}
+
+		list->hooks = hooks;
+		list->alloc = alloc;
+	}
+
+	list->hooks[list->count++] = hook;
+
+	return true;
+}
+
+static bool kvmi_hook_mask( void *arg, struct kvmi_hook *hook )
+{
+	*( unsigned char * )arg |= hook->access;
+
+	return true;
+}
+
+/* the rights removed from a page by the hooks covering it */
+static unsigned char kvmi_hooks_removed( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn )
+{
+	unsigned char removed = 0;
+
+	pthread_mutex_lock( &dom->hooks_lock );
+
+	if ( kvmi_hook_filter_test( dom, gfn ) )
+		kvmi_hooks_overlap( dom, view, gfn << pageshift, ( gfn + 1 ) << pageshift, kvmi_hook_mask, &removed );
+
+	pthread_mutex_unlock( &dom->hooks_lock );
+
+	return removed;
+}
+
+/*
+ * The access of the pages from gfn as set by the others: without the
+ * write access while the dirty tracker protects them and with the SVE bit
+ * recorded in the access shadow. Returns where it changes (at most end).
+ */
+static unsigned long long kvmi_base_access( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn,
+                                            unsigned long long end, unsigned char *access )
+{
+	struct kvmi_access_shadow *root;
+	unsigned long long         k;
+	unsigned char              sve;
+	bool                       protect;
+
+	pthread_mutex_lock( &dom->dirty_lock );
+	protect = kvmi_dirty_protects( dom, view, gfn );
+	for ( k = gfn + 1; k < end && kvmi_dirty_protects( dom, view, k ) == protect; k++ )
+		;
+	pthread_mutex_unlock( &dom->dirty_lock );
+
+	end = k;
+
+	pthread_mutex_lock( &dom->shadow_lock );
+	root = kvmi_shadow_find( dom, view, false );
+	sve  = kvmi_shadow_sve( root, gfn );
+	for ( k = gfn + 1; k < end && kvmi_shadow_sve( root, k ) == sve; k++ )
+		;
+	pthread_mutex_unlock( &dom->shadow_lock );
+
+	*access = ( protect ? DIRTY_PROTECTED_ACCESS : ALL_ACCESS ) | sve;
+
+	return k;
+}
+
+/*
+ * The access a page should have: the rights removed neither by the hooks
+ * nor, if 'protect', by the dirty tracker, and the SVE bit recorded for it
+ * (lost if the rights of the page are unknown).
+ */
+static unsigned char kvmi_page_access_wanted( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn,
+                                              bool protect )
+{
+	struct kvmi_access_shadow *root;
+	unsigned char              sve;
+
+	pthread_mutex_lock( &dom->shadow_lock );
+	root = kvmi_shadow_find( dom, view, false );
+	sve  = kvmi_shadow_sve( root, gfn );
+	pthread_mutex_unlock( &dom->shadow_lock );
+
+	return ( ( protect ? DIRTY_PROTECTED_ACCESS : ALL_ACCESS ) & ~kvmi_hooks_removed( dom, view, gfn ) ) | sve;
+}
+
+struct kvmi_hook_piece {
+	unsigned long long gfn;
+	unsigned long long count;
+	unsigned char      access;
+};
+
+/*
+ * Sets the access of the pages [gfn_start, gfn_end) in a view to what the
+ * hooks covering them require: the base access (see kvmi_base_access())
+ * without the rights removed by any of them. The range is split where
+ * the set of covering hooks or the base access changes and only the
+ * pieces that differ from the access shadow are sent, in one batch.
+ * Called with hooks_apply_lock held.
+ */
+static int kvmi_hooks_apply( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn_start,
+                             unsigned long long gfn_end )
+{
+	struct kvmi_hook_list   found    = {};
+	struct kvmi_hook_piece *pieces   = NULL;
+	struct kvmi_hook_piece *runs     = NULL;
+	unsigned long long *    bounds   = NULL;
+	size_t                  n_bounds = 0, n_pieces = 0, n_runs = 0, max_runs = 0, k, j;
+	void *                  grp = NULL;
+	int                     err = -1;
+
+	pthread_mutex_lock( &dom->hooks_lock );
+
+	kvmi_hooks_overlap( dom, view, gfn_start << pageshift, gfn_end << pageshift, kvmi_hook_collect, &found );
+
+	bounds = found.failed ? NULL : malloc( ( 2 * found.count + 2 ) * sizeof( *bounds ) );
+	if ( !bounds ) {
+		pthread_mutex_unlock( &dom->hooks_lock );
+		free( found.hooks );
+		return -1;
+	}
+
+	bounds[n_bounds++] = gfn_start;
+	bounds[n_bounds++] = gfn_end;
+
+	for ( k = 0; k < found.count; k++ ) {
+		unsigned long long s = found.hooks[k]->start >> pageshift;
+		unsigned long long e = ( ( found.hooks[k]->end - 1 ) >> pageshift ) + 1;
+
+		if ( s > gfn_start && s < gfn_end )
+			bounds[n_bounds++] = s;
+		if ( e > gfn_start && e < gfn_end )
+			bounds[n_bounds++] = e;
+	}
+
+	qsort( bounds, n_bounds, sizeof( *bounds ), compare_ull );
+
+	pieces = malloc( n_bounds * sizeof( *pieces ) );
+	if ( !pieces ) {
+		pthread_mutex_unlock( &dom->hooks_lock );
+		goto out;
+	}
+
+	for ( k = 0; k + 1 < n_bounds; k++ ) {
+		unsigned char removed = 0;
+
+		if ( bounds[k] == bounds[k + 1] )
+			continue;
+
+		for ( j = 0; j < found.count; j++ ) {
+			const struct kvmi_hook *hook = found.hooks[j];
+
+			if ( hook->start >> pageshift <= bounds[k] && ( ( hook->end - 1 ) >> pageshift ) >= bounds[k] )
+				removed |= hook->access;
+		}
+
+		pieces[n_pieces].gfn    = bounds[k];
+		pieces[n_pieces].count  = bounds[k + 1] - bounds[k];
+		pieces[n_pieces].access = ALL_ACCESS & ~removed;
+		n_pieces++;
+	}
+
+	pthread_mutex_unlock( &dom->hooks_lock );
+
+	for ( k = 0; k < n_pieces; k++ ) {
+		unsigned long long gfn = pieces[k].gfn;
+		unsigned long long end = gfn + pieces[k].count;
+
+		while ( gfn < end ) {
+			unsigned long long next;
+			unsigned char      base;
+
+			if ( n_runs == max_runs ) {
+				size_t                  max  = max_runs ? max_runs * 2 : n_pieces;
+				struct kvmi_hook_piece *more = realloc( runs, max * sizeof( *more ) );
+
+				if ( !more )
+					goto out;
+
+				runs     = more;
+				max_runs = max;
+			}
+
+			next = kvmi_base_access( dom, view, gfn, end, &base );
+
+			runs[n_runs].gfn    = gfn;
+			runs[n_runs].count  = next - gfn;
+			runs[n_runs].access = base & ( pieces[k].access | KVMI_PAGE_ACCESS_SVE );
+			n_runs++;
+
+			gfn = next;
+		}
+	}
+
+	grp = kvmi_batch_alloc( dom );
+	if ( !grp )
+		goto out;
+
+	for ( k = 0, j = 0; k < n_runs; k++ ) {
+		if ( kvmi_shadow_range_matches( dom, view, runs[k].gfn, runs[k].count, runs[k].access ) )
+			continue;
+
+		if ( kvmi_queue_page_access_range( grp, runs[k].gfn << pageshift, runs[k].count, runs[k].access,
+		                                   view ) )
+			goto out;
+
+		runs[j++] = runs[k];
+	}
+
+	if ( j && kvmi_batch_commit( grp ) )
+		goto out;
+
+	for ( k = 0; k < j; k++ )
+		kvmi_shadow_update_range( dom, view, runs[k].gfn, runs[k].count, runs[k].access, true );
+
+	err = 0;
+out:
+	kvmi_batch_free( grp );
+	free( runs );
+	free( pieces );
+	free( bounds );
+	free( found.hooks );
+
+	return err;
+}
+
+/*
+ * Registers a hook on [gpa, gpa + size) in a view, that needs the given
+ * rights (KVMI_PAGE_ACCESS_R/W/X) removed. The access of every page is
+ * the combination of all the hooks covering it, so overlapping hooks do
+ * not override each other. The callback is called by kvmi_hook_dispatch()
+ * for the #PF events matching the hook.
+ */
+int kvmi_hook_add( void *d, unsigned long long gpa, unsigned long long size, unsigned char access,
+                   unsigned short view, kvmi_hook_cb cb, void *ctx, unsigned int *id )
+{
+	struct kvmi_dom * dom = d;
+	struct kvmi_hook *hook;
+	size_t            pos;
+	int               err;
+
+	if ( !size || gpa + size < gpa || !( access & ALL_ACCESS ) || !cb ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hook = calloc( 1, sizeof( *hook ) );
+	if ( !hook )
+		return -1;
+
+	hook->view   = view;
+	hook->start  = gpa;
+	hook->end    = gpa + size;
+	hook->access = access & ALL_ACCESS;
+	hook->cb     = cb;
+	hook->ctx    = ctx;
+
+	pthread_mutex_lock( &dom->hooks_apply_lock );
+	pthread_mutex_lock( &dom->hooks_lock );
+
+	if ( !dom->hook_filter ) {
+		dom->hook_filter = calloc( 1, HOOK_FILTER_BITS / 8 );
+		if ( !dom->hook_filter ) {
+			pthread_mutex_unlock( &dom->hooks_lock );
+			pthread_mutex_unlock( &dom->hooks_apply_lock );
+			free( hook );
+			return -1;
+		}
+	}
+
+	if ( dom->hook_count == dom->hook_alloc ) {
+		size_t             alloc = dom->hook_alloc ? dom->hook_alloc * 2 : 64;
+		struct kvmi_hook **hooks = realloc( dom->hooks, alloc * sizeof( *hooks ) );
+
+		if ( !hooks ) {
+			pthread_mutex_unlock( &dom->hooks_lock );
+			pthread_mutex_unlock( &dom->hooks_apply_lock );
+			free( hook );
+			return -1;
+		}
+
+		dom->hooks      = hooks;
+		dom->hook_alloc = alloc;
+	}
+
+	hook->id = ++dom->hook_next_id;
+
+	pos = kvmi_hooks_lower_bound( dom, view, gpa );
+	memmove( dom->hooks + pos + 1, dom->hooks + pos, ( dom->hook_count - pos ) * sizeof( *dom->hooks ) );
+	dom->hooks[pos] = hook;
+	dom->hook_count++;
+	kvmi_hooks_index( dom );
+	kvmi_hook_filter_add( dom, hook );
+
+	pthread_mutex_unlock( &dom->hooks_lock );
+
+	err = kvmi_hooks_apply( dom, view, gpa >> pageshift, ( ( hook->end - 1 ) >> pageshift ) + 1 );
+	if ( err ) {
+		int _errno = errno;
+
+		/* drop the hook and put back the access of the pages that might have changed */
+		pthread_mutex_lock( &dom->hooks_lock );
+		kvmi_hooks_unlink( dom, hook );
+		pthread_mutex_unlock( &dom->hooks_lock );
+
+		kvmi_hooks_apply( dom, view, gpa >> pageshift, ( ( hook->end - 1 ) >> pageshift ) + 1 );
+
+		free( hook );
+		hook  = NULL;
+		errno = _errno;
+	}
+
+	pthread_mutex_unlock( &dom->hooks_apply_lock );
+
+	if ( !err && id )
+		*id = hook->id;
+
+	return err;
+}
+
+int kvmi_hook_remove( void *d, unsigned int id )
+{
+	struct kvmi_dom * dom  = d;
+	struct kvmi_hook *hook = NULL;
+	size_t            k;
+	int               err;
+
+	pthread_mutex_lock( &dom->hooks_apply_lock );
+	pthread_mutex_lock( &dom->hooks_lock );
+
+	for ( k = 0; k < dom->hook_count && !hook; k++ )
+		if ( dom->hooks[k]->id == id )
+			hook = dom->hooks[k];
+
+	if ( hook )
+		kvmi_hooks_unlink( dom, hook );
+
+	pthread_mutex_unlock( &dom->hooks_lock );
+
+	if ( !hook ) {
+		pthread_mutex_unlock( &dom->hooks_apply_lock );
+		errno = ENOENT;
+		return -1;
+	}
+
+	err = kvmi_hooks_apply( dom, hook->view, hook->start >> pageshift, ( ( hook->end - 1 ) >> pageshift ) + 1 );
+
+	pthread_mutex_unlock( &dom->hooks_apply_lock );
+
+	free( hook );
+
+	return err;
+}
+
+/* the hooks matching a #PF event, copied (they may be removed by a callback) */
+struct kvmi_hook_copies {
+	const struct kvmi_event_pf *pf;
+	struct kvmi_hook *          hooks;
+	struct kvmi_hook *          local; /* the initial, caller's, array */
+	size_t                      n;
+	size_t                      max;
+};
+
+static bool kvmi_hook_copy( void *arg, struct kvmi_hook *hook )
+{
+	struct kvmi_hook_copies *copies = arg;
+
+	if ( !( hook->access & copies->pf->access ) )
+		return true;
+
+	if ( copies->n == copies->max ) {
+		struct kvmi_hook *more = malloc( 2 * copies->max * sizeof( *more ) );
+
+		if ( !more )
+			return false;
+
+		memcpy( more, copies->hooks, copies->n * sizeof( *more ) );
+		if ( copies->hooks != copies->local )
+			free( copies->hooks );
+		copies->hooks = more;
+		copies->max *= 2;
+	}
+
+	copies->hooks[copies->n++] = *hook;
+
+	return true;
+}
+
+/*
+ * Calls the callbacks of the hooks matching a #PF event (same view, the
+ * gpa inside the hook and an access the hook has removed). Returns the
+ * number of callbacks called. The hooks can be changed from callbacks.
+ */
+int kvmi_hook_dispatch( void *d, struct kvmi_dom_event *ev )
+{
+	struct kvmi_dom *           dom = d;
+	const struct kvmi_event_pf *pf  = &ev->event.page_fault;
+	struct kvmi_hook            local[16];
+	struct kvmi_hook_copies     copies = { .pf = pf, .hooks = local, .local = local };
+	size_t                      k;
+
+	if ( ev->event.common.event != KVMI_EVENT_PF )
+		return 0;
+
+	copies.max = sizeof( local ) / sizeof( local[0] );
+
+	pthread_mutex_lock( &dom->hooks_lock );
+
+	if ( !kvmi_hook_filter_test( dom, pf->gpa >> pageshift ) ) {
+		pthread_mutex_unlock( &dom->hooks_lock );
+		return 0;
+	}
+
+	kvmi_hooks_overlap( dom, pf->view, pf->gpa, pf->gpa + 1, kvmi_hook_copy, &copies );
+
+	pthread_mutex_unlock( &dom->hooks_lock );
+
+	for ( k = 0; k < copies.n; k++ )
+		copies.hooks[k].cb( dom, ev, copies.hooks[k].ctx );
+
+	if ( copies.hooks != local )
+		free( copies.hooks );
+
+	return copies.n;
+}
+
+struct kvmi_hook_probe {
+	const struct kvmi_event_pf *pf;
+	bool                        matched;
+};
+
+/* stops at the first hook matching the #PF event */
+static bool kvmi_hook_probe( void *arg, struct kvmi_hook *hook )
+{
+	struct kvmi_hook_probe *probe = arg;
+
+	probe->matched = hook->access & probe->pf->access;
+
+	return !probe->matched;
+}
+
+/*
+ * Classifies the #PF events while the hooks are registered. With
+ * auto-reply enabled, those not matching any hook are answered here
+ * (CONTINUE, to let the access go through) and never reach the
+ * application. Called while reading the events, with dom->lock held.
+ */
+static bool kvmi_hook_intercept( struct kvmi_dom *dom, const struct kvmi_dom_event *ev )
+{
+	struct kvmi_hook_probe probe = { .pf = &ev->event.page_fault };
+	bool                   reply;
+
+	if ( ev->event.common.event != KVMI_EVENT_PF )
+		return false;
+
+	pthread_mutex_lock( &dom->hooks_lock );
+
+	if ( !dom->hook_filter ) {
+		pthread_mutex_unlock( &dom->hooks_lock );
+		return false;
+	}
+
+	dom->hook_stats.faults++;
+
+	if ( kvmi_hook_filter_test( dom, probe.pf->gpa >> pageshift ) ) {
+		kvmi_hooks_overlap( dom, probe.pf->view, probe.pf->gpa, probe.pf->gpa + 1, kvmi_hook_probe, &probe );
+
+		if ( !probe.matched )
+			dom->hook_stats.unmatched++;
+	} else
+		dom->hook_stats.prefiltered++;
+
+	reply = !probe.matched && dom->hook_auto_reply;
+
+	pthread_mutex_unlock( &dom->hooks_lock );
+
+	if ( reply ) {
+		struct kvmi_pf_reply_msg rpl;
+		struct iovec             iov = { .iov_base = &rpl, .iov_len = sizeof( rpl ) };
+
+		setup_pf_reply( &rpl, ev, KVMI_EVENT_ACTION_CONTINUE );
+
+		/* if the reply cannot be sent, the event goes to the application */
+		if ( do_write( dom, &iov, 1, sizeof( rpl ) ) )
+			return false;
+
+		pthread_mutex_lock( &dom->hooks_lock );
+		dom->hook_stats.auto_replies++;
+		pthread_mutex_unlock( &dom->hooks_lock );
+	}
+
+	return reply;
+}
+
+/*
+ * Enables or disables the in-library reply to the #PF events that do not
+ * match any registered hook.
+ */
+int kvmi_hook_auto_reply( void *d, bool enable )
+{
+	struct kvmi_dom *dom = d;
+
+	pthread_mutex_lock( &dom->hooks_lock );
+	dom->hook_auto_reply = enable;
+	pthread_mutex_unlock( &dom->hooks_lock );
+
+	return 0;
+}
+
+int kvmi_get_hook_stats( void *d, struct kvmi_hook_stats *stats )
+{
+	struct kvmi_dom *dom = d;
+
+	pthread_mutex_lock( &dom->hooks_lock );
+	*stats = dom->hook_stats;
+	pthread_mutex_unlock( &dom->hooks_lock );
+
+	return 0;
+}
+
+int kvmi_control_spp( void *d, bool enable )
+{
+	struct kvmi_dom *       dom = d;
+	struct kvmi_control_spp req = { .enable = enable };
+
+	if ( request( dom, KVMI_CONTROL_SPP, &req, sizeof( req ), NULL, NULL ) )
+		return -1;
+
+	dom->spp_enabled = enable;
+
+	return 0;
+}
+
+static bool spp_before( const struct kvmi_spp_page *page, unsigned short view, unsigned long long gfn )
+{
+	return page->view < view || ( page->view == view && page->gfn < gfn );
+}
+
+static size_t kvmi_spp_lower_bound( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn )
+{
+	size_t lo = 0, hi = dom->spp_count;
+
+	while ( lo < hi ) {
+		size_t mid = lo + ( hi - lo ) / 2;
+
+		if ( spp_before( &dom->spp_pages[mid], view, gfn ) )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static struct kvmi_spp_page *kvmi_spp_find( struct kvmi_dom *dom, unsigned short view, unsigned long long gfn,
+                                            bool create )
+{
+	size_t                pos = kvmi_spp_lower_bound( dom, view, gfn );
+	struct kvmi_spp_page *page;
+
+	if ( pos < dom->spp_count && dom->spp_pages[pos].view == view && dom->spp_pages[pos].gfn == gfn )
+		return &dom->spp_pages[pos];
+
+	if ( !create )
+		return NULL;
+
+	if ( dom->spp_count == dom->spp_alloc ) {
+		size_t                alloc = dom->spp_alloc ? dom->spp_alloc * 2 : 64;
+		struct kvmi_spp_page *pages = realloc( dom->spp_pages, alloc * sizeof( *pages ) );
+
+		if ( !pages )
+			return NULL;
+
+		dom->spp_pages = pages;
+		dom->spp_alloc = alloc;
+	}
+
+	page = &dom->spp_pages[pos];
+	memmove( page + 1, page, ( dom->spp_count - pos ) * sizeof( *page ) );
+	dom->spp_count++;
+
+	memset( page, 0, sizeof( *page ) );
+	page->gfn  = gfn;
+	page->view = view;
+	page->sent = ~0U; /* all the subpages are writable without SPP */
+
+	return page;
+}
+
+/* bit n is set if the subpage n is writable */
+static __u32 spp_bitmap( const struct kvmi_spp_page *page )
+{
+	__u32    bitmap = 0;
+	unsigned k;
+
+	for ( k = 0; k < SPP_SUBPAGES; k++ )
+		if ( !page->refs[k] )
+			bitmap |= 1U << k;
+
+	return bitmap;
+}
+
+/*
+ * Adds 'delta' to the protection requests of the subpages overlapping
+ * [gpa, gpa + size). Nothing is changed if a counter would overflow or go
+ * below zero. Called with spp_lock held.
+ */
+static int kvmi_spp_change( struct kvmi_dom *dom, unsigned long long gpa, unsigned long long size,
+                            unsigned short view, int delta )
+{
+	unsigned long long first = gpa >> SPP_SUBPAGE_SHIFT;
+	unsigned long long last  = ( gpa + size - 1 ) >> SPP_SUBPAGE_SHIFT;
+	unsigned long long sp;
+
+	for ( sp = first; sp <= last; sp++ ) {
+		struct kvmi_spp_page *page = kvmi_spp_find( dom, view, sp / SPP_SUBPAGES, false );
+		unsigned short        refs = page ? page->refs[sp % SPP_SUBPAGES] : 0;
+
+		if ( ( delta < 0 && !refs ) || ( delta > 0 && refs == USHRT_MAX ) ) {
+			errno = delta < 0 ? EINVAL : EOVERFLOW;
+			return -1;
+		}
+	}
+
+	for ( sp = first; sp <= last; sp++ ) {
+		struct kvmi_spp_page *page = kvmi_spp_find( dom, view, sp / SPP_SUBPAGES, delta > 0 );
+
+		if ( !page ) {
+			/* undo the partial change (no allocations on this path) */
+			if ( sp > first )
+				kvmi_spp_change( dom, gpa, ( sp << SPP_SUBPAGE_SHIFT ) - gpa, view, -delta );
+			return -1;
+		}
+
+		page->refs[sp % SPP_SUBPAGES] += delta;
+		page->dirty = true;
+	}
+
+	return 0;
+}
+
+static int kvmi_spp_request( void *d, unsigned long long gpa, unsigned long long size, unsigned short view,
+                             int delta )
+{
+	struct kvmi_dom *dom = d;
+	int              err;
+
+	if ( !size || gpa + size < gpa ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock( &dom->spp_lock );
+	err = kvmi_spp_change( dom, gpa, size, view, delta );
+	pthread_mutex_unlock( &dom->spp_lock );
+
+	return err;
+}
+
+/*
+ * Requests the write protection of the bytes [gpa, gpa + size), rounded
+ * to 128-byte subpages. The requests are reference counted, so
+ * overlapping ones are merged and each must be undone with
+ * kvmi_spp_unprotect(). Nothing is sent until kvmi_spp_flush().
+ */
+int kvmi_spp_protect( void *dom, unsigned long long gpa, unsigned long long size, unsigned short view )
+{
+	return kvmi_spp_request( dom, gpa, size, view, 1 );
+}
+
+int kvmi_spp_unprotect( void *dom, unsigned long long gpa, unsigned long long size, unsigned short view )
+{
+	return kvmi_spp_request( dom, gpa, size, view, -1 );
+}
+
+/*
+ * Sends the write bitmaps changed since the last flush, in one batch.
+ * SPP is enabled first, if needed. The pages left without protected
+ * subpages are made fully writable and forgotten.
+ */
+int kvmi_spp_flush( void *d )
+{
+	struct kvmi_dom *dom = d;
+	__u64            gpa[SPP_BITMAP_MAX_ENTRIES];
+	__u32            bitmap[SPP_BITMAP_MAX_ENTRIES];
+	unsigned short   view = 0;
+	void *           grp  = NULL;
+	size_t           k, j, n = 0;
+	int              err = -1;
+
+	pthread_mutex_lock( &dom->spp_lock );
+
+	if ( !dom->spp_enabled && kvmi_control_spp( dom, true ) )
+		goto out;
+
+	grp = kvmi_batch_alloc( dom );
+	if ( !grp )
+		goto out;
+
+	for ( k = 0; k < dom->spp_count; k++ ) {
+		struct kvmi_spp_page *page = &dom->spp_pages[k];
+
+		if ( !page->dirty || spp_bitmap( page ) == page->sent )
+			continue;
+
+		/* one message per view */
+		if ( n == SPP_BITMAP_MAX_ENTRIES || ( n && page->view != view ) ) {
+			if ( kvmi_queue_spp_access( grp, gpa, bitmap, view, n ) )
+				goto out;
+			n = 0;
+		}
+
+		view      = page->view;
+		gpa[n]    = page->gfn << pageshift;
+		bitmap[n] = spp_bitmap( page );
+		n++;
+	}
+
+	if ( n && kvmi_queue_spp_access( grp, gpa, bitmap, view, n ) )
+		goto out;
+
+	if ( kvmi_batch_commit( grp ) )
+		goto out;
+
+	for ( k = 0, j = 0; k < dom->spp_count; k++ ) {
+		struct kvmi_spp_page *page = &dom->spp_pages[k];
+
+		page->sent  = spp_bitmap( page );
+		page->dirty = false;
+
+		if ( page->sent != ~0U )
+			dom->spp_pages[j++] = *page;
+	}
+	dom->spp_count = j;
+
+	err = 0;
+out:
+	kvmi_batch_free( grp );
+	pthread_mutex_unlock( &dom->spp_lock );
+
+	return err;
+}
+
+/* the per-vCPU view state, allocated on first use */
+static struct kvmi_vcpu_views *kvmi_views_vcpu( struct kvmi_dom *dom, unsigned short vcpu, bool create )
+{
+	if ( vcpu >= dom->vcpu_views_count ) {
+		size_t                  count = ( size_t )vcpu + 1;
+		struct kvmi_vcpu_views *views;
+
+		if ( !create )
+			return NULL;
+
+		views = realloc( dom->vcpu_views, count * sizeof( *views ) );
+		if ( !views )
+			return NULL;
+
+		memset( views + dom->vcpu_views_count, 0, ( count - dom->vcpu_views_count ) * sizeof( *views ) );
+		dom->vcpu_views       = views;
+		dom->vcpu_views_count = count;
+	}
+
+	return &dom->vcpu_views[vcpu];
+}
+
+static void kvmi_views_set_vcpu( struct kvmi_dom *dom, unsigned short vcpu, unsigned short view, bool known )
+{
+	struct kvmi_vcpu_views *v;
+
+	pthread_mutex_lock( &dom->views_lock );
+
+	v = kvmi_views_vcpu( dom, vcpu, known );
+	if ( v ) {
+		v->view       = view;
+		v->view_known = known;
+	}
+
+	pthread_mutex_unlock( &dom->views_lock );
+}
+
+/* whether the guest can switch the vCPU to another view by itself */
+static bool kvmi_views_any_visible( const struct kvmi_vcpu_views *v )
+{
+	size_t k;
+
+	for ( k = 0; k < MAX_EPT_VIEWS / 64; k++ )
+		if ( v->visible[k] )
+			return true;
+
+	return false;
+}
+
+static bool kvmi_views_get_vcpu( struct kvmi_dom *dom, unsigned short vcpu, unsigned short *view )
+{
+	struct kvmi_vcpu_views *v;
+	bool                    known = false;
+
+	pthread_mutex_lock( &dom->views_lock );
+
+	v = kvmi_views_vcpu( dom, vcpu, false );
+	if ( v && v->view_known && !kvmi_views_any_visible( v ) ) {
+		*view = v->view;
+		known = true;
+	}
+
+	pthread_mutex_unlock( &dom->views_lock );
+
+	return known;
+}
+
+static void kvmi_views_set_created( struct kvmi_dom *dom, unsigned short view, bool created )
+{
+	size_t k;
+
+	if ( view >= MAX_EPT_VIEWS )
+		return;
+
+	pthread_mutex_lock( &dom->views_lock );
+
+	if ( created )
+		set_gfn( dom->views_created, view );
+	else {
+		dom->views_created[view / 64] &= ~( 1ULL << ( view % 64 ) );
+		for ( k = 0; k < dom->vcpu_views_count; k++ )
+			dom->vcpu_views[k].visible[view / 64] &= ~( 1ULL << ( view % 64 ) );
+	}
+
+	pthread_mutex_unlock( &dom->views_lock );
+}
+
+static void kvmi_views_set_visible( struct kvmi_dom *dom, unsigned short vcpu, unsigned short view, bool visible )
+{
+	struct kvmi_vcpu_views *v;
+
+	if ( view >= MAX_EPT_VIEWS )
+		return;
+
+	pthread_mutex_lock( &dom->views_lock );
+
+	v = kvmi_views_vcpu( dom, vcpu, true );
+	if ( v ) {
+		if ( visible )
+			set_gfn( v->visible, view );
+		else
+			v->visible[view / 64] &= ~( 1ULL << ( view % 64 ) );
+	}
+
+	pthread_mutex_unlock( &dom->views_lock );
+}
+
+/* every event carries the view of its vCPU */
+static void kvmi_views_observe_event( struct kvmi_dom *dom, const struct kvmi_dom_event *ev )
+{
+	kvmi_views_set_vcpu( dom, ev->event.common.vcpu, ev->event.common.arch.view, true );
+}
+
+/*
+ * Returns the views created through this library (and the default one),
+ * in ascending order. 'count' holds the size of the array on entry.
+ */
+int kvmi_get_ept_views( void *d, unsigned short *views, size_t *count )
+{
+	struct kvmi_dom *dom = d;
+	size_t           n   = 0;
+	unsigned short   view;
+
+	pthread_mutex_lock( &dom->views_lock );
+
+	for ( view = 0; view < MAX_EPT_VIEWS; view++ ) {
+		if ( !test_gfn( dom->views_created, view ) )
+			continue;
+		if ( n < *count )
+			views[n] = view;
+		n++;
+	}
+
+	pthread_mutex_unlock( &dom->views_lock );
+
+	if ( n > *count ) {
+		*count = n;
+		errno  = ENOSPC;
+		return -1;
+	}
+
+	*count = n;
+
+	return 0;
+}
+
+/* whether the view was made visible to the vCPU by kvmi_control_ept_view() */
+int kvmi_get_ept_view_visible( void *d, unsigned short vcpu, unsigned short view, bool *visible )
+{
+	struct kvmi_dom *       dom = d;
+	struct kvmi_vcpu_views *v;
+
+	if ( view >= MAX_EPT_VIEWS ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock( &dom->views_lock );
+
+	v        = kvmi_views_vcpu( dom, vcpu, false );
+	*visible = v && test_gfn( v->visible, view );
+
+	pthread_mutex_unlock( &dom->views_lock );
+
+	return 0;
+}
+
+static void setup_kvmi_switch_ept_view_msg( struct kvmi_switch_ept_view_msg *msg, unsigned short vcpu,
+                                            unsigned short view )
+{
+	memset( msg, 0, sizeof( *msg ) );
+
+	msg->hdr.id   = KVMI_SWITCH_EPT_VIEW;
+	msg->hdr.seq  = new_seq();
+	msg->hdr.size = sizeof( *msg ) - sizeof( msg->hdr );
+
+	msg->vcpu.vcpu = vcpu;
+	msg->cmd.view  = view;
+}
+
+int kvmi_queue_switch_ept_view( void *grp, unsigned short vcpu, unsigned short view )
+{
+	struct kvmi_switch_ept_view_msg msg;
+
+	setup_kvmi_switch_ept_view_msg( &msg, vcpu, view );
+
+	/* the outcome is known only after the commit */
+	kvmi_views_set_vcpu( ( ( struct kvmi_batch * )grp )->dom, vcpu, view, false );
+
+	return kvmi_batch_add( grp, &msg, sizeof( msg ) );
+}
+
+/* Switches the given vCPUs to the same view, with one batch */
+int kvmi_switch_ept_views( void *dom, const unsigned short *vcpus, size_t count, unsigned short view )
+{
+	void * grp;
+	size_t k;
+	int    err = -1;
+
+	grp = kvmi_batch_alloc( dom );
+	if ( !grp )
+		return -1;
+
+	for ( k = 0; k < count; k++ )
+		if ( kvmi_queue_switch_ept_view( grp, vcpus[k], view ) )
+			goto out;
+
+	if ( kvmi_batch_commit( grp ) )
+		goto out;
+
+	for ( k = 0; k < count; k++ )
+		kvmi_views_set_vcpu( dom, vcpus[k], view, true );
+
+	err = 0;
+out:
+	kvmi_batch_free( grp );
+
+	return err;
+}
+
+static int kvmi_spare_gfn_alloc_locked( struct kvmi_dom *dom, unsigned long long *gfn )
+{
+	if ( dom->spare_count ) {
+		*gfn = dom->spare_gfns[--dom->spare_count];
+		return 0;
+	}
+
+	if ( kvmi_get_next_available_gfn( dom, gfn ) )
+		return -1;
+
+	return kvmi_alloc_gfn( dom, *gfn );
+}
+
+static int kvmi_spare_gfn_free_locked( struct kvmi_dom *dom, unsigned long long gfn )
+{
+	if ( dom->spare_count == dom->spare_alloc ) {
+		size_t              alloc = dom->spare_alloc ? dom->spare_alloc * 2 : 64;
+		unsigned long long *gfns  = realloc( dom->spare_gfns, alloc * sizeof( *gfns ) );
+
+		/* give it back to the host */
+		if ( !gfns )
+			return kvmi_free_gfn( dom, gfn );
+
+		dom->spare_gfns  = gfns;
+		dom->spare_alloc = alloc;
 	}
 
-	return err;
-}
+	dom->spare_gfns[dom->spare_count++] = gfn;
 
-void kvmi_set_log_cb( kvmi_log_cb cb, void *ctx )
-{
-	log_cb  = cb;
-	log_ctx = ctx;
+	return 0;
 }
 
-int kvmi_get_maximum_gfn( void *dom, unsigned long long *gfn )
+/*
+ * Returns a gfn outside the guest memory, backed by host memory. The
+ * freed ones are kept in a pool and reused, as the host does not reuse
+ * them.
+ */
+int kvmi_spare_gfn_alloc( void *d, unsigned long long *gfn )
 {
-	struct kvmi_get_max_gfn_reply rpl;
-	size_t                        received = sizeof( rpl );
-	int                           err;
+	struct kvmi_dom *dom = d;
+	int              err;
 
-	err = request( dom, KVMI_GET_MAX_GFN, NULL, 0, &rpl, &received );
-	if ( !err )
-		*gfn = rpl.gfn;
+	pthread_mutex_lock( &dom->alias_lock );
+	err = kvmi_spare_gfn_alloc_locked( dom, gfn );
+	pthread_mutex_unlock( &dom->alias_lock );
 
 	return err;
 }
 
-int kvmi_get_next_available_gfn( void *dom, unsigned long long *gfn )
+int kvmi_spare_gfn_free( void *d, unsigned long long gfn )
 {
-	struct kvmi_get_next_available_gfn_reply rpl;
-	size_t                                   received = sizeof( rpl );
-	int                                      err;
+	struct kvmi_dom *dom = d;
+	int              err;
 
-	err = request( dom, KVMI_GET_NEXT_AVAILABLE_GFN, NULL, 0, &rpl, &received );
-	if ( !err )
-		*gfn = rpl.gfn;
+	pthread_mutex_lock( &dom->alias_lock );
+	err = kvmi_spare_gfn_free_locked( dom, gfn );
+	pthread_mutex_unlock( &dom->alias_lock );
 
 	return err;
 }
 
-/* begin of VE related functions */
-int kvmi_set_ve_info_page( void *dom, unsigned short vcpu, unsigned long long int gpa )
+static struct kvmi_page_alias *kvmi_alias_find( struct kvmi_dom *dom, unsigned long long gfn, unsigned short view )
 {
-	struct {
-		struct kvmi_vcpu_hdr         hdr;
-		struct kvmi_set_ve_info_page cmd;
-	} req = { .hdr = { .vcpu = vcpu }, .cmd = { .gpa = gpa } };
+	list_t *i;
 
-	return request( dom, KVMI_SET_VE_INFO_PAGE, &req, sizeof( req ), NULL, 0 );
-}
+	list_for_each( i, &dom->aliases )
+	{
+		struct kvmi_page_alias *alias = list_container( i, struct kvmi_page_alias, link );
 
-int kvmi_switch_ept_view( void *dom, unsigned short vcpu, unsigned short view )
-{
-	struct {
-		struct kvmi_vcpu_hdr            hdr;
-		struct kvmi_switch_ept_view_req cmd;
-	} req = { .hdr = { .vcpu = vcpu }, .cmd = { .view = view } };
+		if ( alias->gfn == gfn && alias->view == view )
+			return alias;
+	}
 
-	return request( dom, KVMI_SWITCH_EPT_VIEW, &req, sizeof( req ), NULL, 0 );
+	return NULL;
 }
 
-int kvmi_disable_ve( void *dom, unsigned short vcpu )
+/*
+ * Backs the page 'gfn' in 'view' with a spare gfn holding a copy of the
+ * original page. The other views still see the original page, so a hook
+ * can be written in the alias (e.g. an execute-only view) without being
+ * visible to reads from the other views. The spare gfn is returned in
+ * 'alias_gfn' (if not NULL).
+ * The page is copied while the guest may run, so the vCPUs that can write
+ * it must be paused (or stopped in an event) for the duration of the call.
+ * The original page is checked again after the remap and, if it changed
+ * meanwhile, the alias is dropped and EAGAIN is returned.
+ */
+int kvmi_alias_page( void *d, unsigned long long gfn, unsigned short view, unsigned long long *alias_gfn )
 {
-	struct kvmi_vcpu_hdr req = { .vcpu = vcpu };
+	struct kvmi_dom *       dom = d;
+	struct kvmi_page_alias *alias;
+	unsigned char *         page;
+	int                     err = -1;
 
-	return request( dom, KVMI_DISABLE_VE, &req, sizeof( req ), NULL, 0 );
+	/* the copy and, after it, the page read again */
+	page  = malloc( 2 * pagesize );
+	alias = calloc( 1, sizeof( *alias ) );
+	if ( !page || !alias )
+		goto out_free;
+
+	pthread_mutex_lock( &dom->alias_lock );
+
+	if ( kvmi_alias_find( dom, gfn, view ) ) {
+		errno = EEXIST;
+		goto out;
+	}
+
+	if ( kvmi_spare_gfn_alloc_locked( dom, &alias->alias_gfn ) )
+		goto out;
+
+	/* the mapped memory is used if enabled */
+	if ( kvmi_read_physical( dom, gfn << pageshift, page, pagesize )
+	     || kvmi_write_physical( dom, alias->alias_gfn << pageshift, page, pagesize )
+	     || kvmi_change_gfn( dom, 0, view, gfn, alias->alias_gfn ) ) {
+		int _errno = errno;
+
+		kvmi_spare_gfn_free_locked( dom, alias->alias_gfn );
+		errno = _errno;
+		goto out;
+	}
+
+	/* a write to the original page during the copy would be missing from the alias */
+	err = kvmi_read_physical( dom, gfn << pageshift, page + pagesize, pagesize );
+	if ( !err && memcmp( page, page + pagesize, pagesize ) ) {
+		errno = EAGAIN;
+		err   = -1;
+	}
+
+	if ( err ) {
+		int _errno = errno;
+
+		/* the spare gfn stays out of use if the original page cannot be put back */
+		if ( !kvmi_change_gfn( dom, 0, view, gfn, gfn ) )
+			kvmi_spare_gfn_free_locked( dom, alias->alias_gfn );
+		errno = _errno;
+		goto out;
+	}
+
+	alias->gfn  = gfn;
+	alias->view = view;
+	list_add_tail( &dom->aliases, &alias->link );
+
+	if ( alias_gfn )
+		*alias_gfn = alias->alias_gfn;
+
+	alias = NULL;
+	err   = 0;
+out:
+	pthread_mutex_unlock( &dom->alias_lock );
+out_free:
+	free( alias );
+	free( page );
+
+	return err;
 }
 
-int kvmi_get_ept_view( void *dom, unsigned short vcpu, unsigned short *view )
+/* Points 'gfn' in 'view' back to the original page and recycles the alias */
+int kvmi_unalias_page( void *d, unsigned long long gfn, unsigned short view )
 {
-	struct kvmi_vcpu_hdr           req = { .vcpu = vcpu };
-	struct kvmi_get_ept_view_reply rpl;
-	int                            err;
-	size_t                         received = sizeof( rpl );
+	struct kvmi_dom *       dom = d;
+	struct kvmi_page_alias *alias;
+	int                     err = -1;
 
-	err = request( dom, KVMI_GET_EPT_VIEW, &req, sizeof( req ), &rpl, &received );
-	if ( !err )
-		*view = rpl.view;
+	pthread_mutex_lock( &dom->alias_lock );
+
+	alias = kvmi_alias_find( dom, gfn, view );
+	if ( !alias ) {
+		errno = ENOENT;
+		goto out;
+	}
+
+	if ( kvmi_change_gfn( dom, 0, view, gfn, gfn ) )
+		goto out;
+
+	list_del( &alias->link );
+	err = kvmi_spare_gfn_free_locked( dom, alias->alias_gfn );
+	free( alias );
+out:
+	pthread_mutex_unlock( &dom->alias_lock );
 
 	return err;
 }
 
-int kvmi_control_ept_view( void *dom, unsigned short vcpu, unsigned short view, bool visible )
+/*
+ * Removes all the aliases and gives the spare gfns back to the host.
+ * Stops at the first error.
+ */
+int kvmi_alias_release( void *d )
 {
-	struct {
-		struct kvmi_vcpu_hdr             hdr;
-		struct kvmi_control_ept_view_req cmd;
-	} req = { .hdr = { .vcpu = vcpu }, .cmd = { .view = view, .visible = visible } };
+	struct kvmi_dom *dom = d;
+	list_t *         i;
+	list_t *         j;
+	int              err = 0;
+
+	pthread_mutex_lock( &dom->alias_lock );
+
+	list_for_each_safe( i, j, &dom->aliases )
+	{
+		struct kvmi_page_alias *alias = list_container( i, struct kvmi_page_alias, link );
+
+		err = kvmi_change_gfn( dom, 0, alias->view, alias->gfn, alias->gfn );
+		if ( err )
+			goto out;
+
+		list_del( &alias->link );
+		err = kvmi_spare_gfn_free_locked( dom, alias->alias_gfn );
+		free( alias );
+		if ( err )
+			goto out;
+	}
+
+	while ( dom->spare_count ) {
+		err = kvmi_free_gfn( dom, dom->spare_gfns[dom->spare_count - 1] );
+		if ( err )
+			goto out;
+		dom->spare_count--;
+	}
+out:
+	pthread_mutex_unlock( &dom->alias_lock );
 
-	return request( dom, KVMI_CONTROL_EPT_VIEW, &req, sizeof( req ), NULL, 0 );
+	return err;
 }
-/* end of VE related functions */
 
-int kvmi_control_singlestep( void *dom, unsigned short vcpu, bool enable )
+/* the guest is gone, only the memory is released */
+static void kvmi_aliases_free( struct kvmi_dom *dom )
 {
-	struct {
-		struct kvmi_vcpu_hdr                vcpu;
-		struct kvmi_vcpu_control_singlestep cmd;
-	} req = { .vcpu = { .vcpu = vcpu }, .cmd = { .enable = enable } };
+	list_t *i;
+	list_t *j;
 
-	return request( dom, KVMI_VCPU_CONTROL_SINGLESTEP, &req, sizeof( req ), NULL, NULL );
+	list_for_each_safe( i, j, &dom->aliases )
+	{
+		struct kvmi_page_alias *alias = list_container( i, struct kvmi_page_alias, link );
+
+		list_del( &alias->link );
+		free( alias );
+	}
+
+	free( dom->spare_gfns );
+	dom->spare_gfns  = NULL;
+	dom->spare_count = 0;
+	dom->spare_alloc = 0;
 }
 
-int kvmi_get_xcr( void *dom, unsigned short vcpu, __u8 xcr, __u64 *value )
+static struct kvmi_ve_vcpu *kvmi_ve_vcpu( struct kvmi_dom *dom, unsigned short vcpu, bool create )
 {
-	struct {
-		struct kvmi_vcpu_hdr     hdr;
-		struct kvmi_vcpu_get_xcr cmd;
-	} req = { .hdr = { .vcpu = vcpu }, .cmd = { .xcr = xcr } };
-	struct kvmi_vcpu_get_xcr_reply rpl;
-	int                            err;
-	size_t                         received = sizeof( rpl );
+	if ( vcpu >= dom->ve_vcpu_count ) {
+		size_t               count = ( size_t )vcpu + 1;
+		struct kvmi_ve_vcpu *ve;
 
-	err = request( dom, KVMI_VCPU_GET_XCR, &req, sizeof( req ), &rpl, &received );
-	if ( !err )
-		*value = rpl.value;
+		if ( !create )
+			return NULL;
 
-	return err;
+		ve = realloc( dom->ve_vcpus, count * sizeof( *ve ) );
+		if ( !ve )
+			return NULL;
+
+		memset( ve + dom->ve_vcpu_count, 0, ( count - dom->ve_vcpu_count ) * sizeof( *ve ) );
+		dom->ve_vcpus      = ve;
+		dom->ve_vcpu_count = count;
+	}
+
+	return &dom->ve_vcpus[vcpu];
 }
 
-int kvmi_set_xsave( void *dom, unsigned short vcpu, const void *buffer, size_t size )
+/*
+ * Enables #VE for a vCPU. The info page is the one at '*gpa' or, with
+ * 'alloc', a zeroed spare gfn (outside the guest memory) whose address is
+ * returned in '*gpa'. The page is kept mapped, to be read without I/O by
+ * kvmi_ve_get_info().
+ */
+int kvmi_ve_enable( void *d, unsigned short vcpu, bool alloc, unsigned long long *gpa )
 {
-	struct kvmi_msg_hdr  hdr;
-	struct kvmi_vcpu_hdr vcpu_hdr;
-	struct iovec         iov[]    = {
-                { .iov_base = &hdr, .iov_len = sizeof( hdr ) },
-                { .iov_base = &vcpu_hdr, .iov_len = sizeof( vcpu_hdr ) },
-                { .iov_base = ( void * )buffer, .iov_len = size },
-	};
-	size_t n          = sizeof( iov ) / sizeof( iov[0] );
-	size_t total_size = sizeof( hdr ) + sizeof( vcpu_hdr ) + size;
+	struct kvmi_dom *    dom = d;
+	struct kvmi_ve_vcpu *ve;
+	unsigned long long   gfn;
+	int                  err = -1;
 
-	memset( &hdr, 0, sizeof( hdr ) );
+	if ( !alloc && ( *gpa & ( pagesize - 1 ) ) ) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	hdr.id   = KVMI_VCPU_SET_XSAVE;
-	hdr.seq  = new_seq();
-	hdr.size = total_size - sizeof( hdr );
+	pthread_mutex_lock( &dom->ve_lock );
 
-	memset( &vcpu_hdr, 0, sizeof( vcpu_hdr ) );
+	ve = kvmi_ve_vcpu( dom, vcpu, true );
+	if ( !ve )
+		goto out;
 
-	vcpu_hdr.vcpu = vcpu;
+	if ( ve->enabled ) {
+		errno = EBUSY;
+		goto out;
+	}
 
-	return request_iov( dom, iov, n, total_size, NULL, NULL );
-}
+	if ( alloc ) {
+		void *zero = calloc( 1, pagesize );
 
-int kvmi_translate_gva( void *dom, unsigned short vcpu, __u64 gva, __u64 *gpa )
-{
-	struct {
-		struct kvmi_vcpu_hdr           vcpu;
-		struct kvmi_vcpu_translate_gva cmd;
-	} req = { .vcpu = { .vcpu = vcpu }, .cmd = { .gva = gva } };
-	struct kvmi_vcpu_translate_gva_reply rpl;
-	size_t                               received = sizeof( rpl );
-	int                                  err;
+		if ( !zero || kvmi_spare_gfn_alloc( dom, &gfn ) ) {
+			free( zero );
+			goto out;
+		}
+
+		*gpa = gfn << pageshift;
+
+		err = kvmi_write_physical( dom, *gpa, zero, pagesize );
+		free( zero );
+	} else
+		err = 0;
 
-	err = request( dom, KVMI_VCPU_TRANSLATE_GVA, &req, sizeof( req ), &rpl, &received );
 	if ( !err )
-		*gpa = rpl.gpa;
+		err = kvmi_control_ve( dom, vcpu, *gpa, true );
+
+	if ( err ) {
+		if ( alloc ) {
+			int _errno = errno;
+
+			kvmi_spare_gfn_free( dom, gfn );
+			errno = _errno;
+		}
+		goto out;
+	}
+
+	ve->page = kvmi_map_physical_page( dom, *gpa );
+	if ( ve->page == MAP_FAILED )
+		ve->page = NULL;
+
+	ve->gpa       = *gpa;
+	ve->allocated = alloc;
+	ve->enabled   = true;
+out:
+	pthread_mutex_unlock( &dom->ve_lock );
 
 	return err;
 }
 
-int kvmi_change_gfn( void *dom, unsigned short vcpu, unsigned short view, __u64 old_gfn, __u64 new_gfn )
+int kvmi_ve_disable( void *d, unsigned short vcpu )
 {
-	struct {
-		struct kvmi_vcpu_hdr        vcpu;
-		struct kvmi_vcpu_change_gfn cmd;
-	} req = { .vcpu = { .vcpu = vcpu }, .cmd = { .view = view, .old_gfn = old_gfn, .new_gfn = new_gfn } };
+	struct kvmi_dom *    dom = d;
+	struct kvmi_ve_vcpu *ve;
+	int                  err = -1;
 
-	return request( dom, KVMI_VCPU_CHANGE_GFN, &req, sizeof( req ), NULL, NULL );
-}
+	pthread_mutex_lock( &dom->ve_lock );
 
-int kvmi_alloc_gfn( void *dom, __u64 gfn )
-{
-	struct {
-		struct kvmi_vcpu_hdr        vcpu;
-		struct kvmi_vcpu_alloc_gfn  cmd;
-	} req = { .vcpu = { .vcpu = 0 }, .cmd = { .gfn = gfn } };
+	ve = kvmi_ve_vcpu( dom, vcpu, false );
+	if ( !ve || !ve->enabled ) {
+		errno = EINVAL;
+		goto out;
+	}
 
-	return request( dom, KVMI_VCPU_ALLOC_GFN, &req, sizeof( req ), NULL, NULL );
+	err = kvmi_control_ve( dom, vcpu, 0, false );
+	if ( err )
+		goto out;
+
+	if ( ve->page )
+		kvmi_unmap_physical_page( dom, ve->page );
+	if ( ve->allocated )
+		kvmi_spare_gfn_free( dom, ve->gpa >> pageshift );
+
+	memset( ve, 0, sizeof( *ve ) );
+out:
+	pthread_mutex_unlock( &dom->ve_lock );
+
+	return err;
 }
 
-int kvmi_free_gfn( void *dom, __u64 gfn )
+/*
+ * Decodes the virtualization-exception information area (Intel SDM,
+ * 25.5.7.2): the exit reason, the semaphore, the exit qualification,
+ * the guest-linear and guest-physical addresses and the EPTP index.
+ */
+void kvmi_ve_decode_info( const void *page, struct kvmi_ve_info *info )
 {
-	struct {
-		struct kvmi_vcpu_hdr        vcpu;
-		struct kvmi_vcpu_free_gfn   cmd;
-	} req = { .vcpu = { .vcpu = 0 }, .cmd = { .gfn = gfn } };
+	const unsigned char *p = page;
+	__u32                semaphore;
 
-	return request( dom, KVMI_VCPU_FREE_GFN, &req, sizeof( req ), NULL, NULL );
+	memcpy( &info->exit_reason, p, sizeof( __u32 ) );
+	memcpy( &semaphore, p + 4, sizeof( __u32 ) );
+	memcpy( &info->qualification, p + 8, sizeof( __u64 ) );
+	memcpy( &info->gla, p + 16, sizeof( __u64 ) );
+	memcpy( &info->gpa, p + 24, sizeof( __u64 ) );
+	memcpy( &info->eptp_index, p + 32, sizeof( __u16 ) );
+
+	info->pending = semaphore != 0;
+
+	/* bits 0-2 are the attempted access, as R/W/X */
+	info->access    = info->qualification & ( KVMI_PAGE_ACCESS_R | KVMI_PAGE_ACCESS_W | KVMI_PAGE_ACCESS_X );
+	info->gla_valid = info->qualification & ( 1ULL << 7 );
 }
 
-int kvmi_create_ept_view( void *dom, unsigned short *view )
+/* Reads and decodes the #VE info page of a vCPU */
+int kvmi_ve_get_info( void *d, unsigned short vcpu, struct kvmi_ve_info *info )
 {
-	struct kvmi_create_ept_view_reply rpl;
-	int                               err;
-	size_t                            received = sizeof( rpl );
+	struct kvmi_dom *    dom = d;
+	struct kvmi_ve_vcpu *ve;
+	unsigned char        buf[VE_INFO_SIZE];
+	int                  err = -1;
 
-	err = request( dom, KVMI_CREATE_EPT_VIEW, NULL, 0, &rpl, &received );
-	if ( !err && view )
-		*view = rpl.view;
+	pthread_mutex_lock( &dom->ve_lock );
+
+	ve = kvmi_ve_vcpu( dom, vcpu, false );
+	if ( !ve || !ve->enabled ) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	if ( ve->page )
+		memcpy( buf, ve->page, sizeof( buf ) );
+	else if ( kvmi_read_physical( dom, ve->gpa, buf, sizeof( buf ) ) )
+		goto out;
+
+	kvmi_ve_decode_info( buf, info );
+	err = 0;
+out:
+	pthread_mutex_unlock( &dom->ve_lock );
 
 	return err;
 }
 
-int kvmi_destroy_ept_view( void *dom, unsigned short view )
+/* Clears the semaphore, so that the next #VE can be delivered */
+int kvmi_ve_rearm( void *d, unsigned short vcpu )
 {
-	struct kvmi_destroy_ept_view req = { .view = view };
+	struct kvmi_dom *    dom = d;
+	struct kvmi_ve_vcpu *ve;
+	__u32                semaphore = 0;
+	int                  err       = -1;
+
+	pthread_mutex_lock( &dom->ve_lock );
 
-	return request( dom, KVMI_DESTROY_EPT_VIEW, &req, sizeof( req ), NULL, 0 );
+	ve = kvmi_ve_vcpu( dom, vcpu, false );
+	if ( !ve || !ve->enabled ) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	if ( ve->page ) {
+		memcpy( ( char * )ve->page + 4, &semaphore, sizeof( semaphore ) );
+		err = 0;
+	} else
+		err = kvmi_write_physical( dom, ve->gpa + 4, &semaphore, sizeof( semaphore ) );
+out:
+	pthread_mutex_unlock( &dom->ve_lock );
+
+	return err;
 }